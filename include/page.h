@@ -3,6 +3,7 @@
 
 #include <yalnix.h>
 #include <hardware.h>
+#include <stdbool.h>
 #include <list.h>
 
 #define PAGE_KINDEX(addr) ((addr) ? (unsigned long)(addr) >> PAGESHIFT : 0)
@@ -13,14 +14,36 @@
 #define PAGE_KADDR(index) ((index) << PAGESHIFT)
 #define PAGE_UADDR(index) (((index) << PAGESHIFT) + VMEM_1_BASE)
 
+#define MAX_ORDER		11	/* buddy blocks of 2^0 ... 2^10 frames */
+#define FRAME_CACHE_BATCH	16	/* frames moved between stack and buddy */
+#define FRAME_CACHE_HIGH	64	/* drain the stack beyond this */
+#define ZERO_POOL_MAX		32	/* pre-zeroed frames kept at most */
+#define ZERO_POOL_BATCH		4	/* frames zeroed per idle clock tick */
+#define FREE_FRAMES_LOW		16	/* wake background reclaim below this */
+#define FREE_FRAMES_HIGH	48	/* background reclaim stops at this */
+
+#define FRAME_BUDDY		0x1	/* heads a free block in the buddy system */
+#define FRAME_SWAPCACHE		0x2	/* swap_slot still holds its content */
+
+/* one descriptor per physical frame, indexed by frame number */
 struct phy_frame {
-	struct list_head list;
-	unsigned int index;
+	struct list_head list;	/* linked to free_area if heading a free block */
+	unsigned int order;	/* order of the free block it heads */
+	unsigned int flags;
+	unsigned int count;	/* references from page tables and the kernel */
+	unsigned int swap_slot;	/* the slot it was swapped in from */
 };
 
-struct phy_free_frames {
+struct free_area {
 	struct list_head head;
-	unsigned int n;
+	unsigned int nr_free;	/* number of free blocks of this order */
+};
+
+/* order-0 free frames cached in front of the buddy system */
+struct phy_free_frames {
+	unsigned int *frames;	/* stack of free physical frame numbers */
+	unsigned int n;		/* number of free frames on the stack */
+	unsigned int size;	/* capacity of the stack */
 };
 
 struct my_pte {
@@ -28,31 +51,90 @@ struct my_pte {
 	u_long prot	: 3;	/* page protection bits */
 	u_long cow	: 1;	/* copy_on_write bit */
 	u_long swap	: 1;	/* swap flage */
-	u_long reserved	: 2;	/* reserved; currently unused */
+	u_long ref	: 1;	/* referenced since the clock hand passed */
+	u_long dirty	: 1;	/* written since swapped in */
 	u_long pfn	: 24;	/* page frame number */
 };
 
+/* a resident page whose valid bit the clock hand cleared to catch the
+ * next reference to it; it still owns its frame */
+#define pte_sampled(ptep) (!(ptep)->valid && !(ptep)->swap && (ptep)->prot)
+#define pte_resident(ptep) ((ptep)->valid || pte_sampled(ptep))
+
+#define TLB_BATCH_MAX		8	/* flush the whole region beyond this */
+
+/* kernel virtual pages right below the kernel stack, reserved for
+ * mapping frames the kernel copies between */
+#define COPY_WINDOW_SLOTS	16
+#define COPY_WINDOW_BASE	(KERNEL_STACK_BASE - COPY_WINDOW_SLOTS * PAGESIZE)
+
+/* page table entries changed by one operation, flushed at commit */
+struct tlb_batch {
+	struct my_pte *table;
+	unsigned int n;
+	unsigned int pages[TLB_BATCH_MAX];
+};
+
+struct zero_pool_stat {
+	unsigned long hits;	/* zeroed frames taken from the pool */
+	unsigned long misses;	/* zeroed synchronously by the taker */
+	unsigned long zeroed;	/* frames zeroed into the pool */
+};
+
+struct tlb_stat {
+	unsigned long page_flushes;	/* single page flushes issued */
+	unsigned long full_flushes;	/* whole region flushes issued */
+	unsigned long avoided;		/* page flushes batched away or skipped */
+};
+
 extern unsigned long _text_start, _text_end, _data_end, _kbrk, _kstack_base;
 extern unsigned int total_pages;
 extern struct my_pte *page_table_0;
+extern struct phy_frame *mem_map;
+extern unsigned int max_pfn;
+extern struct free_area free_area[MAX_ORDER];
+extern struct tlb_stat tlb_stat;
+extern struct zero_pool_stat zero_pool_stat;
+extern unsigned int zero_frame;
 
-struct phy_frame *get_free_frame();
-void remove_free_frame(struct phy_frame *frame);
+int init_free_frames(unsigned int n_frame);
+int alloc_frames(unsigned int order, unsigned int *pfn);
+void free_frames(unsigned int pfn, unsigned int order);
+void free_frames_range(unsigned int start, unsigned int end);
+unsigned int nr_free_frames(void);
+int get_free_frame(unsigned int *index);
+int get_free_frames(unsigned int n_frame, unsigned int *record);
+int get_zeroed_frame(unsigned int *index);
+unsigned int refill_zeroed_frames(unsigned int n_frame);
 int add_free_frame(unsigned int index);
+void get_frame(unsigned int index);
+int put_frame(unsigned int index);
+int init_zero_frame(void);
+
+void tlb_batch_init(struct tlb_batch *batch, struct my_pte *table);
+void tlb_batch_add(struct tlb_batch *batch, unsigned int index);
+void tlb_batch_commit(struct tlb_batch *batch);
 
 int map_pages(struct my_pte *, unsigned int, unsigned int, int);
-int map_pages_and_copy(struct my_pte *, struct my_pte *, unsigned long,
+int map_zeroed_pages(struct my_pte *, unsigned int, unsigned int, int);
+int map_zero_pages(struct my_pte *, unsigned int, unsigned int);
+int map_shared_page(struct my_pte *table, unsigned int index,
+		unsigned int pfn, int prot, int cow);
+void *frame_map(unsigned int pfn);
+void frame_unmap(void *addr);
+int copy_frame(unsigned int dest, unsigned int src);
+int copy_frame_from(unsigned int dest, unsigned int src, unsigned int offset);
+int clear_frame(unsigned int index);
+int map_pages_and_copy(struct my_pte *, struct my_pte *,
 		unsigned int, unsigned int);
 int get_free_pages(unsigned int *record, unsigned int n_page);
-int get_free_pages_and_copy(unsigned int *, struct my_pte *,
-		unsigned long, unsigned int, unsigned int);
 #ifdef COW
-int page_cow_copy(struct my_pte *d_table, struct my_pte *s_table,
-		unsigned long source_brk, unsigned int page_index);
+int page_cow_copy(struct my_pte *table, unsigned int page_index);
 #endif
 int update_pages_prot(struct my_pte *, unsigned int, unsigned int, int);
 int update_pages_indexes(struct my_pte *, unsigned int, unsigned int,
 		unsigned int *);
+unsigned int remap_kernel_stack(unsigned int *pfns);
 #ifdef COW
 int update_pages_cow(struct my_pte *table, unsigned int start_index,
 		unsigned int n_page, int cow);
@@ -0,0 +1,38 @@
+#ifndef PCACHE_H
+#define PCACHE_H
+
+#include <list.h>
+#include <vma.h>
+
+#define PCACHE_HASH_BITS	6
+
+/* a page of an executable kept in memory for the next process mapping it */
+struct pcache_page {
+	struct hlist_node	hlist;
+	struct list_head	lru;	/* least recently used first */
+	dev_t			dev;
+	ino_t			ino;
+	time_t			mtime;
+	unsigned long		offset;	/* file offset of the page */
+	unsigned long		len;	/* bytes from the file, zeros after */
+	unsigned int		pfn;	/* the cache holds one reference */
+};
+
+struct pcache_stat {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned int nr_pages;
+};
+
+extern struct pcache_stat pcache_stat;
+
+int pcache_lookup(struct vm_file *file, unsigned long offset,
+		unsigned long len, unsigned int *pfn);
+int pcache_insert(struct vm_file *file, unsigned long offset,
+		unsigned long len, unsigned int pfn);
+int pcache_release(struct vm_file *file, unsigned long offset,
+		unsigned int pfn);
+unsigned int pcache_shrink(unsigned int n_frame);
+
+#endif
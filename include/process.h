@@ -5,10 +5,15 @@
 #include <hardware.h>
 #include <list.h>
 #include <page.h>
+#include <vma.h>
 #include <hash.h>
 
 #define MAX_NUM_OPEN		128
 #define PROCESS_HASH_BITS	6
+#define HEAP_RETAIN_DEFAULT	16	/* heap pages kept mapped above brk */
+#define STACK_SHRINK_DELAY	10	/* ticks a stack page stays unused */
+#define KSTACK_NPG		PAGE_NR(KERNEL_STACK_MAXSIZE)
+#define KSTACK_POOL_MAX		4	/* free kernel stacks kept for fork */
 
 #define set_current_state(state_value)			\
 	do { current->state = (state_value); }		\
@@ -41,26 +46,51 @@ struct task_struct {
 	struct list_head	child_link;	/* child link */
 	struct list_head	wait_list;	/* listed to the state queues */
 	struct list_head	zombie_head;	/* zombie childrens */
-#ifdef COW
-	struct list_head	cow_list;	/* copy-on-write list */
-#endif
 	bool			wait_child_flag;
 	struct hlist_node	hlist;		/* hashed to the global hash table*/
+	struct list_head	run_link;	/* task_run_list, by last run */
+	unsigned long		last_run;	/* when it last left the cpu */
 
 	struct user_context	ucontext;
 	KernelContext		kcontext;
 
-	unsigned int		stack_phy_pages[PAGE_NR(KERNEL_STACK_MAXSIZE)];
-	unsigned int		code_start, code_pgn;	/* code page index and page number */
-	unsigned int		data_start, data_pgn;	/* data page idnex and page number */
+	unsigned int		stack_phy_pages[KSTACK_NPG];
 	unsigned long		brk;		/* break address */
-	unsigned long		stack_start, stack_pgn;
 	unsigned long		arg_start, arg_end;
-	//struct vm_area_struct	*mmap;		/* kernel address space mapped to virtual address space in user space */
+	struct list_head	mmap;		/* sorted vm_area_struct list of user space */
 	struct my_pte		*page_table;
 	char			*tty_buf;
 	struct utility		*utilities[MAX_NUM_OPEN];
-	bool			swapped;
+	unsigned int		clock_hand;	/* next page for reclaim */
+	unsigned int		rss;		/* resident pages, zero frame aside */
+	unsigned int		ra_next;	/* swap fault expected next */
+	unsigned int		ra_window;	/* pages read per swap fault */
+	unsigned int		reclaim_round;	/* last reclaim taking from it */
+	unsigned long		swap_outs;	/* pages reclaim took from it */
+	unsigned int		heap_retain;	/* freed heap pages kept mapped */
+	unsigned int		stack_low;	/* lowest stack page used lately */
+	unsigned long		stack_since;	/* when stack_low was reset */
+};
+
+struct stack_stat {
+	unsigned long grows;
+	unsigned long grow_pages;
+	unsigned long shrinks;
+	unsigned long shrink_pages;
+};
+
+struct kstack_stat {
+	unsigned long reused;		/* kernel stacks taken from the pool */
+	unsigned long allocated;	/* kernel stacks taken from the allocator */
+	unsigned long bytes_copied;	/* live kernel stack copied on fork */
+};
+
+struct switch_stat {
+	unsigned long switches;
+	unsigned long kstack_kept;	/* switches needing no kernel stack remap */
+	unsigned long kstack_pages;	/* kernel stack pages remapped */
+	unsigned long last_jiffies;	/* tick of the latest switch */
+	unsigned long tick_switches;	/* switches within that tick */
 };
 
 struct zombie_task_struct {
@@ -71,20 +101,38 @@ struct zombie_task_struct {
 
 extern unsigned int _top_pid;
 extern struct task_struct *current;
+extern struct stack_stat stack_stat;
+extern struct kstack_stat kstack_stat;
+extern struct switch_stat switch_stat;
 extern struct task_struct idle_task;
 extern struct task_struct init_task;
 extern struct task_struct *tty_writing_tasks[NUM_TERMINALS];
 extern struct task_struct *tty_reading_tasks[NUM_TERMINALS];
 extern DECLARE_HASHTABLE(process_hash_table, PROCESS_HASH_BITS);
+extern struct list_head task_run_list;
 
 extern struct task_struct *alloc_and_init_task(struct task_struct *parent);
 extern int task_vm_copy(struct task_struct *to, struct task_struct *from);
 extern int task_cow_copy_page(struct task_struct *task,
 			unsigned int page_index);
 extern void task_vm_expand_stack(struct task_struct *task, int increment);
-
-extern void task_address_space_free(struct task_struct *task);
+extern int task_vm_fault(struct task_struct *task, unsigned int page_index);
+extern void task_stack_update(struct task_struct *task, void *sp);
+extern unsigned int task_stack_trim(struct task_struct *task);
+extern int task_kstack_clone(struct task_struct *task, void *sp);
+extern unsigned int task_heap_trim(struct task_struct *task,
+			unsigned int keep);
+extern void task_heap_reuse(struct task_struct *task,
+			unsigned int start_index, unsigned int end_index);
+extern int task_vm_prefault(struct task_struct *task, void *addr, size_t len,
+			bool write);
+extern int task_vm_prefault_string(struct task_struct *task, char *str);
+extern struct vm_area_struct *task_vma(struct task_struct *task,
+			unsigned int flags);
+
+extern void task_address_space_unmap(struct task_struct *task);
 extern void free_task(struct task_struct *task);
+extern void task_fork_abort(struct task_struct *child);
 extern struct zombie_task_struct *task_alloc_zombie(struct task_struct *task);
 extern void free_zombie(struct zombie_task_struct *zombie);
 
@@ -95,6 +143,7 @@ extern void task_info_parent(struct task_struct *parent, int exit_code);
 extern void initialize_processes_at_boot(void);
 extern void ready_enqueue(struct task_struct *task);
 extern void ready_queue_insert(struct task_struct *task);
+extern void ready_queue_swap_ahead(void);
 
 extern void tty_read_enqueue(struct task_struct *task, unsigned int tty_id);
 extern void tty_reading_wake_up(unsigned int tty_id);
@@ -0,0 +1,37 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <list.h>
+
+#define SLAB_SIZE	PAGESIZE	/* bytes carved from the kernel heap */
+#define SLAB_ALIGN	sizeof(long)
+
+/* free objects of one type, linked through their first word */
+struct kmem_cache {
+	const char		*name;
+	size_t			size;		/* object size */
+	void			*free_list;
+	struct list_head	list;		/* linked to all caches */
+	unsigned long		nr_slabs;	/* slabs taken from the heap */
+	unsigned long		nr_objs;	/* objects in those slabs */
+	unsigned long		nr_active;	/* objects handed out */
+	unsigned long		nr_allocs;
+	unsigned long		nr_frees;
+};
+
+#define KMEM_CACHE_INIT(cache_name, type) {				\
+	.name = (cache_name),						\
+	.size = sizeof(type),						\
+	.free_list = NULL,						\
+	.list = { NULL, NULL },						\
+}
+
+#define DEFINE_KMEM_CACHE(var, cache_name, type)			\
+	struct kmem_cache var = KMEM_CACHE_INIT(cache_name, type)
+
+void kmem_cache_init(struct kmem_cache *cache, const char *name, size_t size);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_cache_dump(void);
+
+#endif
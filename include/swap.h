@@ -3,7 +3,66 @@
 
 #include <process.h>
 
+#define SWAP_CLUSTER	8	/* frames reclaimed per direct reclaim */
+#define SWAP_SLOTS	1024	/* pages the swap partition holds */
+#define KSWAPD_BATCH	8	/* frames reclaimed in the background per tick */
+#define SWAP_RA_MAX	8	/* most pages read on one swap fault */
+#define SWAP_IDLE_MAX	100	/* ticks off the cpu counted in a victim score */
+#define SWAP_IO_BATCH	8	/* pages moved to or from swap together */
+#define SWAP_AHEAD_DEPTH	2	/* ready tasks swapped in ahead per tick */
+
+enum swap_victim_policy {
+	SWAP_VICTIM_SCORE,	/* resident size, idle time and state */
+	SWAP_VICTIM_LRU,	/* the task that ran longest ago */
+};
+
+/* pages of one task moving between frames and swap slots together */
+struct swap_batch {
+	unsigned int n;
+	unsigned int pages[SWAP_IO_BATCH];	/* page indexes */
+	unsigned int slots[SWAP_IO_BATCH];
+	unsigned int frames[SWAP_IO_BATCH];
+	void *addrs[SWAP_IO_BATCH];		/* the frames in the copy window */
+	bool disk[SWAP_IO_BATCH];		/* through the swap partition */
+	int ret;
+};
+
+struct swap_stat {
+	unsigned long scanned;		/* pages the clock hands looked at */
+	unsigned long victims;		/* tasks picked to take pages from */
+	unsigned long pages_out;
+	unsigned long pages_in;
+	unsigned long text_dropped;	/* clean text pages evicted without I/O */
+	unsigned long cache_kept;	/* pages swapped in keeping their slot */
+	unsigned long cache_hits;	/* clean pages evicted back to their slot */
+	unsigned long writes_avoided;	/* bytes those evictions did not write */
+	unsigned long ahead_pages;	/* pages swapped in ahead of dispatch */
+	unsigned long passed_over;	/* swapped tasks a resident one ran before */
+	unsigned long faults_in;	/* swap faults on single pages */
+	unsigned long ra_pages;		/* pages read ahead of a fault */
+	unsigned int slots_used;	/* swap slots holding a page */
+	unsigned long direct_runs;	/* allocations that had to reclaim */
+	unsigned long direct_pages;
+	unsigned long kswapd_wakeups;	/* free frames fell below the low mark */
+	unsigned long kswapd_pages;	/* frames reclaimed in the background */
+	unsigned long io_calls;		/* reads and writes to the partition */
+	unsigned long io_bytes;
+	unsigned long io_usecs;		/* time spent in them */
+};
+
+extern struct swap_stat swap_stat;
+extern enum swap_victim_policy swap_policy;
+
+unsigned int reclaim_pages(unsigned int n_page);
 int swap_out(void);
+void kswapd_wake(void);
+void kswapd(void);
 int swap_in(struct task_struct *task);
+int swap_in_page(struct task_struct *task, unsigned int page_index);
+bool task_swapped(struct task_struct *task);
+void swap_in_ahead(struct task_struct *task);
+int swap_slot_write(unsigned int slot, void *page);
+void swap_slot_free(unsigned int slot);
+void swap_cache_release(unsigned int pfn);
 
 #endif
@@ -64,6 +64,10 @@ int sys_cvar_broadcast(int cvar_id);
 int sys_cvar_wait(int cvar_id, int lock_id, struct user_context *user_ctx);
 
 int sys_reclaim(unsigned int id);
+int sys_text_dropped(void);
+
+/* sys_load() failed after the old image was gone, the task has to die */
+#define LOAD_KILL	(-2)
 
 int sys_load(char *filename, char **args, struct task_struct *task);
 
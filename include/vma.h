@@ -0,0 +1,68 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include <hardware.h>
+#include <sys/types.h>
+#include <list.h>
+
+/* vm_area_struct flags */
+#define VM_TEXT		0x01	/* program text */
+#define VM_DATA		0x02	/* initialized and uninitialized data */
+#define VM_HEAP		0x04	/* grows with brk */
+#define VM_STACK	0x08	/* user stack, grows down */
+#define VM_SHARED	0x10	/* shared with other processes, not copy-on-write */
+#define VM_ANON		0x20	/* anonymous memory, not from the executable */
+
+/* an executable file whose pages are read in on demand */
+struct vm_file {
+	int			fd;
+	char			*path;
+	unsigned int		count;	/* areas referring to it */
+	dev_t			dev;	/* identity of the file contents, */
+	ino_t			ino;	/* the key of its cached pages */
+	time_t			mtime;
+};
+
+/* a contiguous range of region 1 pages with the same kind of mapping */
+struct vm_area_struct {
+	struct list_head	list;	/* sorted by start in task->mmap */
+	unsigned int		start;	/* first page index */
+	unsigned int		end;	/* one past the last page index */
+	unsigned int		flags;
+	int			prot;	/* protection of the page table entries */
+	struct vm_file		*file;	/* backing executable, or NULL */
+	unsigned long		offset;	/* file offset of the first page */
+	unsigned long		file_size; /* bytes backed by file, zeros after */
+};
+
+#define vma_entry(ptr) list_entry(ptr, struct vm_area_struct, list)
+
+#define vma_for_each(vma, mmap)						\
+	for (vma = vma_entry((mmap)->next); &vma->list != (mmap);	\
+			vma = vma_entry(vma->list.next))
+
+#define vma_for_each_safe(vma, tmp, mmap)				\
+	for (vma = vma_entry((mmap)->next),				\
+			tmp = vma_entry(vma->list.next);		\
+			&vma->list != (mmap);				\
+			vma = tmp, tmp = vma_entry(tmp->list.next))
+
+#define vma_pgn(vma) ((vma)->end - (vma)->start)
+
+struct vm_file *vm_file_alloc(int fd, char *path);
+struct vm_file *vm_file_get(struct vm_file *file);
+void vm_file_put(struct vm_file *file);
+void vma_set_file(struct vm_area_struct *vma, struct vm_file *file,
+		unsigned long offset, unsigned long file_size);
+
+struct vm_area_struct *vma_alloc(unsigned int start, unsigned int end,
+		unsigned int flags, int prot);
+void vma_free(struct vm_area_struct *vma);
+void vma_insert(struct list_head *mmap, struct vm_area_struct *vma);
+struct vm_area_struct *vma_find(struct list_head *mmap, unsigned int index);
+struct vm_area_struct *vma_find_flags(struct list_head *mmap,
+		unsigned int flags);
+int vma_copy(struct list_head *to, struct list_head *from);
+void vma_free_all(struct list_head *mmap);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef ZSWAP_H
+#define ZSWAP_H
+
+#include <list.h>
+
+#define ZSWAP_POOL_PAGES	16	/* memory budget of the compressed pool */
+#define ZSWAP_CHUNK		256	/* pool allocation unit in bytes */
+#define ZSWAP_NR_CHUNKS		(ZSWAP_POOL_PAGES * PAGESIZE / ZSWAP_CHUNK)
+#define ZSWAP_MAX_LEN		(PAGESIZE / 2)	/* keep pages shrinking to this */
+
+enum zswap_kind {
+	ZSWAP_NONE = 0,		/* the slot is on disk, or unused */
+	ZSWAP_SAME,		/* every word of the page is the same */
+	ZSWAP_RLE,		/* run length encoded in the pool */
+};
+
+/* what the compressed tier holds for one swap slot */
+struct zswap_entry {
+	struct list_head	lru;	/* pool entries, least recently stored first */
+	unsigned long		fill;	/* the word of a same filled page */
+	unsigned short		chunk;	/* first pool chunk of the encoding */
+	unsigned short		len;	/* bytes of the encoding */
+	unsigned char		kind;
+};
+
+struct zswap_stat {
+	unsigned long stored;		/* pages kept in memory on swap out */
+	unsigned long same_filled;	/* of them, pages of one repeated word */
+	unsigned long rejected;		/* pages that did not compress well */
+	unsigned long written_back;	/* pages spilled to disk over budget */
+	unsigned long hits;		/* swap ins served from memory */
+	unsigned long misses;		/* swap ins read from disk */
+	unsigned long orig_bytes;	/* page bytes held in the pool */
+	unsigned long pool_bytes;	/* their compressed size */
+};
+
+extern struct zswap_stat zswap_stat;
+
+int zswap_store(unsigned int slot, void *page);
+int zswap_load(unsigned int slot, void *page);
+void zswap_invalidate(unsigned int slot);
+
+#endif
@@ -30,11 +30,13 @@ static void init_kernel_ptes(unsigned int page_index_start,
 	int i;
 	struct my_pte pte;
 
+	bzero(&pte, sizeof(struct my_pte));
 	pte.valid = valid;
 	pte.prot = prot;
 	for (i = page_index_start; i < page_index_end; i++) {
 		pte.pfn = i;
 		page_table_0[i] = pte;
+		mem_map[i].count = 1;
 	}
 
 	return;
@@ -46,11 +48,13 @@ static void init_kernel_ptes(unsigned int page_index_start,
 static void init_kernel_page_table()
 {
 	unsigned int page_index_start, page_index_end;
-	unsigned int i;
 
 	page_table_0 = (void *)calloc(PAGE_NR(VMEM_0_SIZE),
 			sizeof(struct my_pte));
 
+	/* preallocate the frame allocator before _kbrk is used below */
+	init_free_frames(PAGE_KINDEX(UP_TO_PAGE(PMEM_BASE)) + total_pages);
+
 	/* initialize page table for kernel text segment */
 	page_index_start = PAGE_KINDEX(_text_start);
 	page_index_end = PAGE_KINDEX(_text_end);
@@ -66,8 +70,7 @@ static void init_kernel_page_table()
 	/* link free frames between brk and stack base */
 	page_index_start = PAGE_KINDEX(_kbrk);
 	page_index_end = PAGE_KINDEX(KERNEL_STACK_BASE);
-	for (i = page_index_start; i < page_index_end; i++)
-		add_free_frame(i);
+	free_frames_range(page_index_start, page_index_end);
 
 	/* initialize page table for kernel stack */
 	page_index_start = PAGE_KINDEX(KERNEL_STACK_BASE);
@@ -78,8 +81,10 @@ static void init_kernel_page_table()
 	/* link free frames higher than KERNEL_STACK_LIMIT */
 	page_index_start = PAGE_KINDEX(KERNEL_STACK_LIMIT);
 	page_index_end = PAGE_KINDEX(UP_TO_PAGE(PMEM_BASE)) + total_pages;
-	for (i = page_index_start; i < page_index_end; i++)
-		add_free_frame(i);
+	free_frames_range(page_index_start, page_index_end);
+
+	/* the frame shared by all untouched anonymous pages */
+	init_zero_frame();
 
 	return;
 }
@@ -92,10 +97,11 @@ static KernelContext *get_kernel_context(KernelContext *kernel_ctx,
 {
 	struct task_struct *task = a;
 	task->kcontext = *kernel_ctx;
-	get_free_pages_and_copy(task->stack_phy_pages,
-				page_table_0, _kbrk,
-				PAGE_KINDEX(KERNEL_STACK_BASE),
-				PAGE_NR(KERNEL_STACK_MAXSIZE));
+	/* idle can never be switched to without a kernel stack */
+	if (task_kstack_clone(task, &task)) {
+		_error("No kernel stack for the idle task!\n");
+		Halt();
+	}
 	return kernel_ctx;
 }
 
@@ -142,7 +148,10 @@ void KernelStart _PARAMS((char **argv, unsigned int pmem_size,
 
 	/* load init process */
 	init_task.page_table = init_page_table;
-	sys_load(argv[0], argv, &init_task);
+	if (sys_load(argv[0], argv, &init_task)) {
+		_error("Loading %s failed!\n", argv[0]);
+		Halt();
+	}
 
 	current = &init_task;
 
@@ -167,6 +176,12 @@ int SetKernelBrk _PARAMS((void *addr))
 		return ret;
 	}
 
+	/* the pages below the kernel stack are kept for the copy window */
+	if (UP_TO_PAGE(new_brk) > COPY_WINDOW_BASE) {
+		_error("Kernel Brk runs into the copy window!\n");
+		return ERROR;
+	}
+
 	/* if has enabled VM, expand or shrink heap here */
 	if (new_brk > _kbrk) {
 		ret = map_pages(page_table_0,
@@ -2,6 +2,7 @@
 #include <interrupt.h>
 #include <sys.h>
 #include <timer.h>
+#include <swap.h>
 
 #define FROM_USER_SPACE(p) ((p) >= VMEM_1_BASE && (p) < VMEM_1_LIMIT)
 
@@ -131,6 +132,9 @@ void trap_kernel_handler(struct user_context *user_ctx)
 	case YALNIX_CUSTOM_0:
 		SET_RET(user_ctx, sys_fork_share(user_ctx));
 		break;
+	case YALNIX_CUSTOM_1:
+		SET_RET(user_ctx, sys_text_dropped());
+		break;
 	}
 
 	return;
@@ -143,6 +147,16 @@ void trap_clock_handler(struct user_context *user_ctx)
 	/* wake up processes that called Delay() before */
 	wake_up_timer(jiffies);
 
+	/* reclaim ahead of allocations once free frames run low */
+	kswapd();
+
+	/* bring swapped tasks about to run back in */
+	ready_queue_swap_ahead();
+
+	/* spend idle time zeroing free frames, a few per tick */
+	if (current == &idle_task)
+		refill_zeroed_frames(ZERO_POOL_BATCH);
+
 	/* call the Round Robin scheduler */
 	rr_schedule(user_ctx);
 
@@ -161,9 +175,10 @@ void trap_illegal_handler(struct user_context *user_ctx)
 
 /*
  * page fault handler
- * - it deals with 4 scenarios:
+ * - it deals with 5 scenarios:
  *   - expand user space stack
- *   - swap process in
+ *   - swap the faulting page in
+ *   - read in pages of the executable, map demand-zero pages
  *   - do copy-on-write
  *   - handle segment fault
  */
@@ -172,6 +187,7 @@ void trap_memory_handler(struct user_context *user_ctx)
 	unsigned long addr = (unsigned long)user_ctx->addr;
 	unsigned int page_index = PAGE_UINDEX(addr);
 	struct my_pte *ptep = current->page_table + page_index;
+	struct vm_area_struct *stack = task_vma(current, VM_STACK);
 	int ret;
 
 	_enter("pid = %u, at %p(%u), code = %d",
@@ -180,24 +196,34 @@ void trap_memory_handler(struct user_context *user_ctx)
 	switch (user_ctx->code) {
 	case YALNIX_MAPERR:
 		/* expand stack */
-		if (!ptep->swap && page_index == current->stack_start - 1) {
+		if (!ptep->swap && stack && page_index == stack->start - 1) {
 			task_vm_expand_stack(current, 1);
 			break;
 		}
 
-		/* swap process in */
+		/* swap the page in, with some of its neighbours */
 		if (ptep->swap) {
-			ret = swap_in(current);
-			if (ret == EIO) {
-				sys_tty_write(0, "Abort! Swap In error!\n",
+			ret = swap_in_page(current, page_index);
+			/* no frame to swap into would only fault again */
+			if (ret) {
+				sys_tty_write(0, ret == ENOMEM ?
+						"Abort! Out of memory!\n" :
+						"Abort! Swap In error!\n",
 						64, user_ctx);
 				sys_exit(ret, user_ctx);
 			}
+			break;
+		}
+
+		/* read in the executable, demand-zero bss, heap and so on */
+		if (!ptep->valid && task_vm_fault(current, page_index)) {
+			sys_tty_write(0, "Abort! Segment Fault!\n",
+					64, user_ctx);
+			sys_exit(ERROR, user_ctx);
 		}
 
 		break;
 	case YALNIX_ACCERR:
-		break;
 	default:
 #ifdef COW
 		/* do copy-on-write for the parent and children */
@@ -8,6 +8,47 @@
 #include <sys.h>
 #include "internal.h"
 
+/*
+ * build the vm areas of a freshly loaded program: text, initialized data,
+ * demand-zero bss, an empty heap right after bss and the stack up to the
+ * top of region 1
+ */
+static int task_vm_setup(struct task_struct *task,
+			 unsigned int text_pg1, unsigned int text_npg,
+			 unsigned int data_pg1, unsigned int data_npg,
+			 unsigned int bss_npg, unsigned int stack_pg1)
+{
+	struct vm_area_struct *text, *data, *bss, *heap, *stack;
+	unsigned int bss_pg1 = data_pg1 + data_npg;
+	unsigned int heap_pg1 = bss_pg1 + bss_npg;
+
+	text = vma_alloc(text_pg1, text_pg1 + text_npg, VM_TEXT,
+			PROT_READ | PROT_EXEC);
+	data = vma_alloc(data_pg1, bss_pg1, VM_DATA, PROT_READ | PROT_WRITE);
+	bss = vma_alloc(bss_pg1, heap_pg1, VM_DATA | VM_ANON,
+			PROT_READ | PROT_WRITE);
+	heap = vma_alloc(heap_pg1, heap_pg1, VM_HEAP | VM_ANON,
+			PROT_READ | PROT_WRITE);
+	stack = vma_alloc(stack_pg1, PAGE_NR(VMEM_1_SIZE),
+			VM_STACK | VM_ANON, PROT_READ | PROT_WRITE);
+	if (!text || !data || !bss || !heap || !stack) {
+		vma_free(text);
+		vma_free(data);
+		vma_free(bss);
+		vma_free(heap);
+		vma_free(stack);
+		return ENOMEM;
+	}
+
+	vma_insert(&task->mmap, text);
+	vma_insert(&task->mmap, data);
+	vma_insert(&task->mmap, bss);
+	vma_insert(&task->mmap, heap);
+	vma_insert(&task->mmap, stack);
+
+	return 0;
+}
+
 /*
  * Load a program into an existing address space.  The program comes from
  * the Linux file named "name", and its arguments come from the array at
@@ -31,9 +72,10 @@ int sys_load(char *filename, char **args, struct task_struct *task)
 	int data_pg1;
 	int data_npg;
 	int stack_npg;
-	long segment_size;
 	char *argbuf;
 	struct my_pte *page_table;
+	struct vm_file *file;
+	struct vm_area_struct *vma;
 
 	/* open the executable file */
 	if ((fd = open(filename, O_RDONLY)) < 0) {
@@ -121,7 +163,8 @@ int sys_load(char *filename, char **args, struct task_struct *task)
 	cp2 = argbuf = (char *)malloc(size);
 	if (cp2 == NULL) {
 		_error("LoadProgram: memory out!\n");
-		return ERROR;
+		close(fd);
+		return LOAD_KILL;
 	}
 
 	for (i = 0; args[i] != NULL; i++) {
@@ -130,83 +173,67 @@ int sys_load(char *filename, char **args, struct task_struct *task)
 		cp2 += strlen(cp2) + 1;
 	}
 
+	/* the file stays open, text and data are read in page by page as
+	 * they are touched.  The name has to be copied before region 1 is
+	 * gone too */
+	file = vm_file_alloc(fd, filename);
+	if (file == NULL) {
+		free(argbuf);
+		close(fd);
+		return LOAD_KILL;
+	}
+
 	/* allocate page table for this process */
 	if (task->page_table == NULL) {
 		task->page_table = (void *)calloc(PAGE_NR(VMEM_1_SIZE),
 				sizeof(struct my_pte));
 		if (task->page_table == NULL) {
 			_error("LoadProgram: page table memory out!\n");
-			return ERROR;
+			goto kill;
 		}
 	} else
 		task_address_space_unmap(task);
 
 	page_table = task->page_table;
+	task->brk = PAGE_UADDR(data_pg1 + data_npg);
 
-	/* allocate memory for user text */
-	ret = map_pages(page_table, text_pg1, li.t_npg, PROT_READ | PROT_WRITE);
-	if (ret) {
-		_error("Map pages for text segment of %s error!\n", filename);
-		return ret;
-	}
-	task->code_start = text_pg1;
-	task->code_pgn = li.t_npg;
-
-	/* allocate memory for user data */
-	ret = map_pages(page_table, data_pg1, data_npg, PROT_READ | PROT_WRITE);
+	/* describe the new address space first, so that the areas tell
+	 * what to unmap when the process is killed below */
+	ret = task_vm_setup(task, text_pg1, li.t_npg, data_pg1, li.id_npg,
+			li.ud_npg, PAGE_UINDEX(cpp));
 	if (ret) {
-		_error("Map pages for data segment of %s error!\n", filename);
-		return ret;
+		_error("LoadProgram: vm areas memory out!\n");
+		goto kill;
 	}
-	task->data_start = data_pg1;
-	task->data_pgn = data_npg;
-	task->brk = PAGE_UADDR(data_pg1 + data_npg);
 
 	/* allocate memory for the user stack too */
-	ret = map_pages(page_table, PAGE_UINDEX(cpp), stack_npg,
+	ret = map_zeroed_pages(page_table, PAGE_UINDEX(cpp), stack_npg,
 			PROT_READ | PROT_WRITE);
 	if (ret) {
-		_error("Map pages for data segment of %s error!\n", filename);
-		return ret;
+		_error("Map pages for stack of %s error!\n", file->path);
+		goto kill;
 	}
-	task->stack_start = PAGE_UINDEX(cpp);
-	task->stack_pgn = stack_npg;
+	task->rss = stack_npg;
 
-	/* change page table and flush TLB for VM_1 */
-	UPDATE_VM1_AND_FLUSH_TLB(page_table);
+	task->stack_low = PAGE_UINDEX(cpp);
+	task->stack_since = jiffies;
 
-	/* read the text from the file into memory */
-	lseek(fd, li.t_faddr, SEEK_SET);
-	segment_size = li.t_npg << PAGESHIFT;
-	if (read(fd, (void *)li.t_vaddr, segment_size) != segment_size) {
-		_error("LoadProgram: Read text segment ERROR!\n");
-		close(fd);
-		return EIO;
+	/* back text and initialized data by the file. The data area ends
+	 * with the initialized data, so the bss sharing its last page reads
+	 * as zeros */
+	if (li.t_npg) {
+		vma = vma_find(&task->mmap, text_pg1);
+		vma_set_file(vma, file, li.t_faddr, li.t_npg << PAGESHIFT);
 	}
-
-	/* read the data from the file into memory */
-	lseek(fd, li.id_faddr, 0);
-	segment_size = li.id_npg << PAGESHIFT;
-	if (read(fd, (void *)li.id_vaddr, segment_size) != segment_size) {
-		_error("LoadProgram: Read text segment ERROR!\n");
-		close(fd);
-		return EIO;
+	if (li.id_npg) {
+		vma = vma_find(&task->mmap, data_pg1);
+		vma_set_file(vma, file, li.id_faddr,
+				(unsigned long)li.id_end - li.id_vaddr);
 	}
+	vm_file_put(file);
 
-	close(fd);
-
-	/* Now set the page table entries for the program text to be readable
-	 * and executable, but not writable */
-	ret = update_pages_prot(page_table, text_pg1, li.t_npg,
-				PROT_READ | PROT_EXEC);
-	if (ret) {
-		_error("LoadProgram: update text segement for \"%s\" ERROR!\n",
-				filename);
-		return ERROR;
-	}
-
-	/* zero out the uninitialized data area */
-	bzero(li.id_end, li.ud_end - li.id_end);
+	/* change page table and flush TLB for VM_1 */
+	UPDATE_VM1_AND_FLUSH_TLB(page_table);
 
 	/* set the entry point in the exception frame */
 	task->ucontext.pc = (caddr_t)li.entry;
@@ -230,4 +257,9 @@ int sys_load(char *filename, char **args, struct task_struct *task)
 	task->state = TASK_READY;
 
 	return 0;
+
+kill:
+	free(argbuf);
+	vm_file_put(file);
+	return LOAD_KILL;
 }
@@ -1,4 +1,6 @@
 #include <page.h>
+#include <pcache.h>
+#include <swap.h>
 #include <sys.h>
 #include "internal.h"
 
@@ -6,76 +8,574 @@ unsigned long _text_start = 0, _text_end = 0, _data_end = 0,
 	      _kbrk = 0, _kstack_base = 0;
 unsigned int total_pages = 0;
 struct my_pte *page_table_0 = NULL;
+struct tlb_stat tlb_stat = { 0, 0, 0 };
+
+struct phy_frame *mem_map = NULL;
+unsigned int max_pfn = 0;
+struct free_area free_area[MAX_ORDER];
+unsigned int zero_frame = 0;
 
 static struct phy_free_frames phy_free_frames = {
-	.head = { &phy_free_frames.head, &phy_free_frames.head },
+	.frames = NULL,
+	.n = 0,
+	.size = 0,
+};
+
+/* free frames already filled with zeros by the idle task */
+static unsigned int zeroed_frames_buf[ZERO_POOL_MAX];
+static struct phy_free_frames zeroed_frames = {
+	.frames = zeroed_frames_buf,
 	.n = 0,
+	.size = ZERO_POOL_MAX,
 };
+struct zero_pool_stat zero_pool_stat = { 0, 0, 0 };
 
 
 /*
- * try to get a free physical frame.
- * if there is no available frames call swap_out() to get
- * more free frames and return one of them
+ * the smallest order whose block holds at least @n_frame frames
+ */
+static inline unsigned int frames_order(unsigned int n_frame)
+{
+	unsigned int order = 0;
+
+	while ((1U << order) < n_frame)
+		order++;
+	return order;
+}
+
+/**
+ * preallocate the frame descriptors, the buddy free areas and the order-0
+ * free frame stack. It is called once at boot before any frame is freed,
+ * so that frame allocation never touches the heap afterwards
+ * @n_frame: the number of physical frames, i.e. the maximum pfn plus one
  */
-inline struct phy_frame *get_free_frame()
+int init_free_frames(unsigned int n_frame)
 {
+	unsigned int order;
+
+	mem_map = (void *)calloc(n_frame, sizeof(struct phy_frame));
+	phy_free_frames.frames = (void *)calloc(FRAME_CACHE_HIGH + 1,
+			sizeof(unsigned int));
+	if (mem_map == NULL || phy_free_frames.frames == NULL) {
+		_error("Allocating frame allocator failed!!!\n");
+		return ENOMEM;
+	}
+	max_pfn = n_frame;
+	phy_free_frames.n = 0;
+	phy_free_frames.size = FRAME_CACHE_HIGH + 1;
+
+	for (order = 0; order < MAX_ORDER; order++) {
+		INIT_LIST_HEAD(&free_area[order].head);
+		free_area[order].nr_free = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * allocate a block of 2^@order physically contiguous frames
+ * @order: the order of the block
+ * @pfn: where to record the first frame number of the block
+ */
+int alloc_frames(unsigned int order, unsigned int *pfn)
+{
+	unsigned int cur, index;
 	struct phy_frame *frame;
-	int ret;
 
-	if (list_empty(&phy_free_frames.head)) {
-		ret = swap_out();
-		if (ret || list_empty(&phy_free_frames.head))
-			return NULL;
+	if (order >= MAX_ORDER)
+		return ERROR;
+
+	for (cur = order; cur < MAX_ORDER; cur++)
+		if (!list_empty(&free_area[cur].head))
+			break;
+	if (cur == MAX_ORDER)
+		return ENOMEM;
+
+	frame = list_entry(list_first(&free_area[cur].head),
+			struct phy_frame, list);
+	list_del(&frame->list);
+	free_area[cur].nr_free--;
+	frame->flags &= ~FRAME_BUDDY;
+	index = frame - mem_map;
+
+	/* split the block, giving the upper halves back */
+	while (cur > order) {
+		struct phy_frame *buddy;
+
+		cur--;
+		buddy = mem_map + index + (1U << cur);
+		buddy->order = cur;
+		buddy->flags |= FRAME_BUDDY;
+		list_add(&free_area[cur].head, &buddy->list);
+		free_area[cur].nr_free++;
+	}
+
+	*pfn = index;
+	return 0;
+}
+
+/**
+ * give a block of 2^@order frames back to the buddy system and merge
+ * it with its free buddies
+ * @pfn: the first frame number of the block
+ * @order: the order of the block
+ */
+void free_frames(unsigned int pfn, unsigned int order)
+{
+	while (order < MAX_ORDER - 1) {
+		unsigned int buddy_pfn = pfn ^ (1U << order);
+		struct phy_frame *buddy = mem_map + buddy_pfn;
+
+		if (buddy_pfn >= max_pfn || !(buddy->flags & FRAME_BUDDY) ||
+				buddy->order != order)
+			break;
+
+		list_del(&buddy->list);
+		buddy->flags &= ~FRAME_BUDDY;
+		free_area[order].nr_free--;
+		pfn &= buddy_pfn;
+		order++;
+	}
+
+	mem_map[pfn].order = order;
+	mem_map[pfn].flags |= FRAME_BUDDY;
+	list_add(&free_area[order].head, &mem_map[pfn].list);
+	free_area[order].nr_free++;
+
+	return;
+}
+
+/**
+ * give a range of frames to the buddy system at boot, in the largest
+ * aligned blocks possible
+ * @start: the first frame number of the range
+ * @end: one past the last frame number of the range
+ */
+void free_frames_range(unsigned int start, unsigned int end)
+{
+	while (start < end) {
+		unsigned int order = 0;
+
+		while (order < MAX_ORDER - 1 &&
+				!(start & ((1U << (order + 1)) - 1)) &&
+				start + (1U << (order + 1)) <= end)
+			order++;
+		free_frames(start, order);
+		start += 1U << order;
 	}
 
-	frame = (struct phy_frame *)list_first(&phy_free_frames.head);
+	return;
+}
 
-	return frame;
+/*
+ * the number of free frames in the stack and in the buddy system
+ */
+unsigned int nr_free_frames(void)
+{
+	unsigned int order, n = phy_free_frames.n;
+
+	for (order = 0; order < MAX_ORDER; order++)
+		n += free_area[order].nr_free << order;
+	return n;
 }
 
 /*
- * remove the frame from free list and free it
+ * refill the order-0 free frame stack from the buddy system
  */
-inline void remove_free_frame(struct phy_frame *frame)
+static inline unsigned int refill_free_frames(void)
 {
-	list_del(&frame->list);
-	phy_free_frames.n--;
-	free(frame);
+	unsigned int i, pfn;
+
+	for (i = 0; i < FRAME_CACHE_BATCH; i++) {
+		if (alloc_frames(0, &pfn))
+			break;
+		phy_free_frames.frames[phy_free_frames.n++] = pfn;
+	}
+
+	return i;
+}
+
+/*
+ * drain part of the order-0 free frame stack back to the buddy system
+ * so that they have a chance to coalesce
+ */
+static inline void drain_free_frames(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < FRAME_CACHE_BATCH && phy_free_frames.n; i++)
+		free_frames(phy_free_frames.frames[--phy_free_frames.n], 0);
 
 	return;
 }
 
 /**
- * allocate and add a new physical frame to the free list
+ * try to get a free physical frame.
+ * if there is no available frames take a pre-zeroed one, drop idle
+ * cached executable pages, then call swap_out() to get more free frames
+ * and return one of them. Background reclaim is woken when free frames
+ * run low
+ * @index: where to record the physical frame number
+ */
+inline int get_free_frame(unsigned int *index)
+{
+	struct phy_free_frames *frames = &phy_free_frames;
+	int ret;
+
+	if (phy_free_frames.n == 0 && refill_free_frames() == 0) {
+		if (zeroed_frames.n) {
+			frames = &zeroed_frames;
+		} else if (pcache_shrink(FRAME_CACHE_BATCH) == 0) {
+			ret = swap_out();
+			if (ret || (phy_free_frames.n == 0 &&
+						refill_free_frames() == 0))
+				return ENOMEM;
+		}
+	}
+
+	*index = frames->frames[--frames->n];
+	mem_map[*index].count = 1;
+
+	if (phy_free_frames.n < FREE_FRAMES_LOW &&
+			nr_free_frames() < FREE_FRAMES_LOW)
+		kswapd_wake();
+
+	return 0;
+}
+
+/**
+ * get a free physical frame filled with zeros, from the pool the idle
+ * task keeps if possible, otherwise zeroing it right now
+ * @index: where to record the physical frame number
+ */
+int get_zeroed_frame(unsigned int *index)
+{
+	int ret;
+
+	if (zeroed_frames.n) {
+		*index = zeroed_frames.frames[--zeroed_frames.n];
+		mem_map[*index].count = 1;
+		zero_pool_stat.hits++;
+		return 0;
+	}
+
+	zero_pool_stat.misses++;
+	ret = get_free_frame(index);
+	if (ret)
+		return ret;
+
+	ret = clear_frame(*index);
+	if (ret)
+		put_frame(*index);
+
+	return ret;
+}
+
+/**
+ * zero a bounded number of free frames into the pool. It is called from
+ * the clock trap while the idle task runs, and leaves a reserve of free
+ * frames alone so that the pool never pushes anybody into swapping
+ * @n_frame: the most frames to zero this time
+ */
+unsigned int refill_zeroed_frames(unsigned int n_frame)
+{
+	unsigned int i, index;
+
+	for (i = 0; i < n_frame && zeroed_frames.n < zeroed_frames.size; i++) {
+		if (nr_free_frames() <= FRAME_CACHE_HIGH)
+			break;
+		if (phy_free_frames.n == 0 && refill_free_frames() == 0)
+			break;
+
+		index = phy_free_frames.frames[--phy_free_frames.n];
+		if (clear_frame(index)) {
+			phy_free_frames.frames[phy_free_frames.n++] = index;
+			break;
+		}
+		zeroed_frames.frames[zeroed_frames.n++] = index;
+		zero_pool_stat.zeroed++;
+	}
+
+	return i;
+}
+
+/**
+ * get some free physical frames at once. Either all of them are got
+ * or none of them
+ * @n_frame: the number of frames to get
+ * @record: the array to record the physical frame numbers
+ */
+int get_free_frames(unsigned int n_frame, unsigned int *record)
+{
+	unsigned int i;
+
+	/* fast path: pop them all from the top of the stack */
+	if (phy_free_frames.n >= n_frame) {
+		phy_free_frames.n -= n_frame;
+		memcpy(record, phy_free_frames.frames + phy_free_frames.n,
+				n_frame * sizeof(unsigned int));
+		for (i = 0; i < n_frame; i++)
+			mem_map[record[i]].count = 1;
+		return 0;
+	}
+
+	for (i = 0; i < n_frame; i++) {
+		if (get_free_frame(record + i)) {
+			collect_back_pages(record, i);
+			return ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * turn a physical frame back to the free stack
  * @index: the new available physical frame number
  */
 inline int add_free_frame(unsigned int index)
 {
-	struct phy_frame *frame;
+	if (index >= max_pfn) {
+		_error("Freeing invalid frame #%u!!!\n", index);
+		return ERROR;
+	}
+
+	if (phy_free_frames.n >= FRAME_CACHE_HIGH)
+		drain_free_frames();
+	phy_free_frames.frames[phy_free_frames.n++] = index;
+
+	return 0;
+}
+
+/*
+ * set aside the frame every untouched anonymous page maps to. It is called
+ * at boot before VM is enabled, so the frame is zeroed through its
+ * physical address. The boot reference pins it forever
+ */
+int init_zero_frame(void)
+{
+	if (get_free_frame(&zero_frame)) {
+		_error("Allocating zero frame failed!!!\n");
+		return ENOMEM;
+	}
+	bzero((void *)PAGE_KADDR(zero_frame), PAGESIZE);
+
+	return 0;
+}
+
+/**
+ * map some virtual pages to zero-filled physical frames
+ * @table: the page table to be manipulated
+ * @start_index: the start page index in the page table to be mapped
+ * @n_page: the number of pages to be mapped
+ * @prot: the protection of the pages
+ */
+int map_zeroed_pages(struct my_pte *table, unsigned int start_index,
+		unsigned int n_page, int prot)
+{
 	int ret = 0;
+	unsigned int i, end_index = start_index + n_page;
+	struct my_pte pte;
+	struct tlb_batch batch;
 
-	frame = (void *)calloc(1, sizeof(struct phy_frame));
-	if (frame == NULL) {
-		_error("Allocating free physical page failed!!!\n");
-		ret = ENOMEM;
-		goto out;
+	tlb_batch_init(&batch, table);
+	bzero(&pte, sizeof(struct my_pte));
+	pte.valid = 1;
+	pte.prot = prot;
+	for (i = start_index; i < end_index; i++) {
+		unsigned int frame;
+
+		if (get_zeroed_frame(&frame)) {
+			_error("No more physical frames available now!\n");
+			ret = ENOMEM;
+			goto out;
+		}
+		pte.pfn = frame;
+		table[i] = pte;
+		tlb_batch_add(&batch, i);
 	}
-	frame->index = index;
-	list_add(&phy_free_frames.head, &frame->list);
-	phy_free_frames.n++;
 
 out:
+	tlb_batch_commit(&batch);
 	return ret;
 }
 
+/**
+ * map virtual pages read-only to the zero frame, the first write to
+ * each of them gets a private zeroed frame on copy-on-write
+ * @table: the page table to be manipulated
+ * @start_index: the start page index in the page table to be mapped
+ * @n_page: the number of pages to be mapped
+ */
+int map_zero_pages(struct my_pte *table, unsigned int start_index,
+		unsigned int n_page)
+{
+	unsigned int i, end_index = start_index + n_page;
+	struct my_pte pte;
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, table);
+	bzero(&pte, sizeof(struct my_pte));
+	pte.valid = 1;
+	pte.prot = PROT_READ;
+	pte.cow = 1;
+	pte.pfn = zero_frame;
+	for (i = start_index; i < end_index; i++) {
+		get_frame(zero_frame);
+		table[i] = pte;
+		tlb_batch_add(&batch, i);
+	}
+	tlb_batch_commit(&batch);
+
+	return 0;
+}
+
+/**
+ * map a virtual page to a frame somebody else holds, e.g. a cached page
+ * of an executable. The caller has taken the reference for it
+ * @table: the page table to be manipulated
+ * @index: the page index in the page table to be mapped
+ * @pfn: the physical frame number
+ * @prot: the protection of the page
+ * @cow: whether the first write gets a private copy
+ */
+int map_shared_page(struct my_pte *table, unsigned int index,
+		    unsigned int pfn, int prot, int cow)
+{
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, table);
+	bzero(table + index, sizeof(struct my_pte));
+	table[index].valid = 1;
+	table[index].prot = prot;
+	table[index].cow = cow;
+	table[index].pfn = pfn;
+	tlb_batch_add(&batch, index);
+	tlb_batch_commit(&batch);
+
+	return 0;
+}
+
+/**
+ * take one more reference to an allocated frame, e.g. when another
+ * page table entry is made to share it
+ * @index: the physical frame number
+ */
+inline void get_frame(unsigned int index)
+{
+	mem_map[index].count++;
+
+	return;
+}
+
+/**
+ * drop one reference to an allocated frame, it is freed when the last
+ * reference is gone
+ * @index: the physical frame number
+ */
+inline int put_frame(unsigned int index)
+{
+	if (mem_map[index].count == 0) {
+		_error("Putting free frame #%u!!!\n", index);
+		return ERROR;
+	}
+
+	if (--mem_map[index].count)
+		return 0;
+	swap_cache_release(index);
+	return add_free_frame(index);
+}
+
+/*
+ * whether @table is what the MMU is translating through right now.
+ * Region 0 is always loaded, a region 1 table only if it is in REG_PTBR1
+ */
+static inline bool table_loaded(struct my_pte *table)
+{
+	return table == page_table_0 ||
+		(unsigned int)table == ReadRegister(REG_PTBR1);
+}
+
 inline static void flush_TLB(struct my_pte *table)
 {
+	if (!table_loaded(table)) {
+		tlb_stat.avoided++;
+		return;
+	}
+
 	if (table == page_table_0)
 		WriteRegister(REG_TLB_FLUSH, TLB_FLUSH_0);
 	else
 		WriteRegister(REG_TLB_FLUSH, TLB_FLUSH_1);
+	tlb_stat.full_flushes++;
+
+	return;
+}
+
+/**
+ * start a batch of TLB invalidations on a page table
+ * @batch: the batch to be initialized
+ * @table: the page table whose entries are going to be updated
+ */
+void tlb_batch_init(struct tlb_batch *batch, struct my_pte *table)
+{
+	batch->table = table;
+	batch->n = 0;
+
+	return;
+}
+
+/**
+ * record a page table entry that has been changed, the stale TLB entry
+ * is invalidated on tlb_batch_commit()
+ * @batch: the batch to record to
+ * @index: the page index in the page table which has been changed
+ */
+void tlb_batch_add(struct tlb_batch *batch, unsigned int index)
+{
+	if (batch->n < TLB_BATCH_MAX)
+		batch->pages[batch->n] = index;
+	batch->n++;
+
+	return;
+}
+
+/**
+ * issue the TLB invalidations recorded in a batch: one flush per page
+ * for a small batch, or one flush of the whole region past the threshold.
+ * Nothing is flushed if the page table is not loaded in the MMU
+ * @batch: the batch to be committed
+ */
+void tlb_batch_commit(struct tlb_batch *batch)
+{
+	unsigned int i;
+
+	if (batch->n == 0)
+		return;
+
+	if (!table_loaded(batch->table)) {
+		tlb_stat.avoided += batch->n;
+		goto out;
+	}
+
+	if (batch->n > TLB_BATCH_MAX) {
+		flush_TLB(batch->table);
+		tlb_stat.avoided += batch->n - 1;
+		goto out;
+	}
+
+	for (i = 0; i < batch->n; i++) {
+		if (batch->table == page_table_0)
+			WriteRegister(REG_TLB_FLUSH,
+					PAGE_KADDR(batch->pages[i]));
+		else
+			WriteRegister(REG_TLB_FLUSH,
+					PAGE_UADDR(batch->pages[i]));
+	}
+	tlb_stat.page_flushes += batch->n;
 
+out:
+	batch->n = 0;
 	return;
 }
 
@@ -92,76 +592,191 @@ int map_pages(struct my_pte *table, unsigned int start_index,
 	int ret = 0;
 	unsigned int i, end_index = start_index + n_page;
 	struct my_pte pte;
+	struct tlb_batch batch;
 
+	tlb_batch_init(&batch, table);
 	bzero(&pte, sizeof(struct my_pte));
 	pte.valid = 1;
 	pte.prot = prot;
 	for (i = start_index; i < end_index; i++) {
-		struct phy_frame *frame;
+		unsigned int frame;
 
-		frame = get_free_frame();
-		if (frame == NULL) {
+		if (get_free_frame(&frame)) {
 			_error("No more physical frames available now!\n");
 			ret = ENOMEM;
 			goto out;
 		}
-		pte.pfn = frame->index;
+		pte.pfn = frame;
 		table[i] = pte;
-		remove_free_frame(frame);
+		tlb_batch_add(&batch, i);
 	}
 
 out:
-	flush_TLB(table);
+	tlb_batch_commit(&batch);
 	return ret;
 }
 
+/* slots of the copy window in use, one bit per slot */
+static unsigned int copy_window_used = 0;
+
+/**
+ * map a frame into a free slot of the copy window. A slot keeps its
+ * mapping after being released, so mapping the same frame again costs
+ * nothing and only a slot that is remapped needs its TLB entry flushed
+ * @pfn: the physical frame number
+ */
+void *frame_map(unsigned int pfn)
+{
+	unsigned int slot, free_slot = COPY_WINDOW_SLOTS;
+	unsigned int index = PAGE_KINDEX(COPY_WINDOW_BASE);
+	struct my_pte *ptep;
+
+	for (slot = 0; slot < COPY_WINDOW_SLOTS; slot++) {
+		if (copy_window_used & (1U << slot))
+			continue;
+		ptep = page_table_0 + index + slot;
+		if (ptep->valid && ptep->pfn == pfn) {
+			free_slot = slot;
+			break;
+		}
+		if (free_slot == COPY_WINDOW_SLOTS)
+			free_slot = slot;
+	}
+
+	if (free_slot == COPY_WINDOW_SLOTS) {
+		_error("Copy window is full!!!\n");
+		return NULL;
+	}
+
+	copy_window_used |= 1U << free_slot;
+	index += free_slot;
+	ptep = page_table_0 + index;
+	if (ptep->valid && ptep->pfn == pfn) {
+		tlb_stat.avoided++;
+	} else {
+		if (ptep->valid) {
+			WriteRegister(REG_TLB_FLUSH, PAGE_KADDR(index));
+			tlb_stat.page_flushes++;
+		}
+		ptep->valid = 1;
+		ptep->prot = PROT_READ | PROT_WRITE;
+		ptep->pfn = pfn;
+	}
+
+	return (void *)PAGE_KADDR(index);
+}
+
+/**
+ * release a copy window slot taken by frame_map()
+ * @addr: the address frame_map() returned
+ */
+void frame_unmap(void *addr)
+{
+	unsigned int slot = PAGE_KINDEX(addr) - PAGE_KINDEX(COPY_WINDOW_BASE);
+
+	copy_window_used &= ~(1U << slot);
+
+	return;
+}
+
+/**
+ * copy the content of a physical frame to another one
+ * @dest: the frame to be copied to
+ * @src: the frame to be copied from
+ */
+int copy_frame(unsigned int dest, unsigned int src)
+{
+	return copy_frame_from(dest, src, 0);
+}
+
+/**
+ * copy the tail of a physical frame to another one, leaving the bytes
+ * before @offset alone
+ * @dest: the frame to be copied to
+ * @src: the frame to be copied from
+ * @offset: the first byte to be copied
+ */
+int copy_frame_from(unsigned int dest, unsigned int src, unsigned int offset)
+{
+	void *dest_addr, *src_addr;
+
+	dest_addr = frame_map(dest);
+	if (dest_addr == NULL)
+		return ERROR;
+	src_addr = frame_map(src);
+	if (src_addr == NULL) {
+		frame_unmap(dest_addr);
+		return ERROR;
+	}
+
+	memcpy(dest_addr + offset, src_addr + offset, PAGESIZE - offset);
+
+	frame_unmap(src_addr);
+	frame_unmap(dest_addr);
+
+	return 0;
+}
+
+/**
+ * fill a physical frame with zeros
+ * @index: the physical frame number
+ */
+int clear_frame(unsigned int index)
+{
+	void *addr;
+
+	addr = frame_map(index);
+	if (addr == NULL)
+		return ERROR;
+
+	bzero(addr, PAGESIZE);
+	frame_unmap(addr);
+
+	return 0;
+}
+
 #ifdef COW
 /**
- * copy page on copy-on-write
- * @d_table: the page table to be copied to
- * @s_table: the page table to be copiied from
- * @source_brk: the brk address of the source process
+ * copy page on copy-on-write, giving the faulting page table entry a
+ * private writable frame and dropping its reference to the shared one
+ * @table: the page table the faulting entry belongs to
  * @page_index: which page to be made a copy
  */
-int page_cow_copy(struct my_pte *d_table, struct my_pte *s_table,
-		  unsigned long source_brk, unsigned int page_index)
+int page_cow_copy(struct my_pte *table, unsigned int page_index)
 {
 	int ret = 0;
-	unsigned int dest_index;
+	unsigned int frame, old_frame = table[page_index].pfn;
+	struct tlb_batch batch;
 
-	if (d_table[page_index].pfn == s_table[page_index].pfn) {
-		struct phy_frame *frame;
-		frame = get_free_frame();
-		if (frame == NULL) {
+	/* a write to the zero frame only needs a zeroed frame */
+	if (old_frame == zero_frame) {
+		if (get_zeroed_frame(&frame)) {
 			_error("No more physical frames available now!\n");
 			ret = ENOMEM;
 			goto out;
 		}
+	} else {
+		if (get_free_frame(&frame)) {
+			_error("No more physical frames available now!\n");
+			ret = ENOMEM;
+			goto out;
+		}
+		ret = copy_frame(frame, old_frame);
+		if (ret) {
+			put_frame(frame);
+			goto out;
+		}
+	}
 
-		source_brk = UP_TO_PAGE(source_brk);
-		if (s_table == page_table_0)
-			dest_index = PAGE_KINDEX(source_brk);
-		else
-			dest_index = PAGE_UINDEX(source_brk);
-
-		d_table[page_index].pfn = frame->index;
-		d_table[page_index].prot = PROT_READ | PROT_WRITE;
-		d_table[page_index].cow = 0;
-		s_table[dest_index].pfn = frame->index;
-		s_table[dest_index].valid = 1;
-		s_table[dest_index].prot = PROT_READ | PROT_WRITE;
-		WriteRegister(REG_TLB_FLUSH, source_brk);
-
-		if (s_table == page_table_0)
-			memcpy(source_brk, PAGE_KADDR(page_index), PAGESIZE);
-		else
-			memcpy(source_brk, PAGE_UADDR(page_index), PAGESIZE);
-
-		bzero(s_table + dest_index, sizeof(struct my_pte));
-		WriteRegister(REG_TLB_FLUSH, source_brk);
+	tlb_batch_init(&batch, table);
+	table[page_index].pfn = frame;
+	table[page_index].prot = PROT_READ | PROT_WRITE;
+	table[page_index].cow = 0;
+	table[page_index].dirty = 1;
+	tlb_batch_add(&batch, page_index);
+	tlb_batch_commit(&batch);
 
-		remove_free_frame(frame);
-	}
+	put_frame(old_frame);
 out:
 	return ret;
 }
@@ -169,59 +784,48 @@ out:
 
 /**
  * map virtual pages to physical frames and copy the content
- * from another process
+ * from another process. Pages not present in the source are left
+ * unmapped to be faulted in again
  *
  * @d_table: the page table to be copied to
  * @s_table: the page table to be copiied from
- * @source_brk: the brk address of the source process
  * @start_index: the start page index in the page table to be mapped
  * @n_page: the number of pages to be mapped
  */
 int map_pages_and_copy(struct my_pte *d_table,
 		       struct my_pte *s_table,
-		       unsigned long source_brk,
 		       unsigned int start_index,
 		       unsigned int n_page)
 {
 	int ret = 0;
 	unsigned int i, end_index = start_index + n_page;
-	unsigned int dest_index;
 	struct my_pte pte;
 
-	source_brk = UP_TO_PAGE(source_brk);
-	if (s_table == page_table_0)
-		dest_index = PAGE_KINDEX(source_brk);
-	else
-		dest_index = PAGE_UINDEX(source_brk);
-
 	bzero(&pte, sizeof(struct my_pte));
 	pte.valid = 1;
 	pte.prot = PROT_READ | PROT_WRITE;
 	for (i = start_index; i < end_index; i++) {
-		struct phy_frame *frame;
+		unsigned int frame;
+
+		if (!pte_resident(s_table + i))
+			continue;
 
-		frame = get_free_frame();
-		if (frame == NULL) {
+		if (get_free_frame(&frame)) {
 			_error("No more physical frames available now!\n");
 			ret = ENOMEM;
 			goto out;
 		}
-		_debug("frame index = %u, virtual index = %u\n",
-				frame->index, i);
-		pte.pfn = frame->index;
-		d_table[i] = pte;
-		s_table[dest_index] = pte;
-		remove_free_frame(frame);
+		_debug("frame index = %u, virtual index = %u\n", frame, i);
 
-		WriteRegister(REG_TLB_FLUSH, source_brk);
-		if (s_table == page_table_0)
-			memcpy(source_brk, PAGE_KADDR(i), PAGESIZE);
-		else
-			memcpy(source_brk, PAGE_UADDR(i), PAGESIZE);
+		ret = copy_frame(frame, s_table[i].pfn);
+		if (ret) {
+			put_frame(frame);
+			goto out;
+		}
+		pte.pfn = frame;
+		d_table[i] = pte;
 	}
 
-	bzero(s_table + dest_index, sizeof(struct my_pte));
-	WriteRegister(REG_TLB_FLUSH, source_brk);
 out:
 	return ret;
 }
@@ -233,77 +837,25 @@ out:
  */
 int get_free_pages(unsigned int *record, unsigned int n_page)
 {
-	int ret = 0;
-	unsigned int i;
+	int ret;
+	unsigned int i, pfn, order = frames_order(n_page);
 
-	for (i = 0; i < n_page; i++) {
-		struct phy_frame *frame;
-		frame = get_free_frame();
-		if (frame == NULL) {
-			_error("No more physical frames available now!\n");
-			ret = ENOMEM;
-			goto out;
+	/* try a physically contiguous run first */
+	if (n_page > 1 && alloc_frames(order, &pfn) == 0) {
+		for (i = 0; i < n_page; i++) {
+			record[i] = pfn + i;
+			mem_map[pfn + i].count = 1;
 		}
-
-		record[i] = frame->index;
-		remove_free_frame(frame);
+		/* give back the tail the block rounded up to */
+		for (i = n_page; i < (1U << order); i++)
+			free_frames(pfn + i, 0);
+		return 0;
 	}
 
-out:
-	return ret;
-}
-
-/**
- * get some free pages and get a copy of the content
- * from another process
- *
- * @record: the array to record the indexes of physical frames
- * @s_table: the page table to be copiied from
- * @source_brk: the brk address of the source process
- * @start_index: the start page index in the page table to be get
- * @n_page: the number of pages to get
- *
- * NOTE: This is different from map_pages_and_copy(). map_pages_and_copy()
- * would map virtual address space to physical frames, but this function
- * just get free physical pages and write their contents.
- */
-int get_free_pages_and_copy(unsigned int *record,
-		struct my_pte *s_table, unsigned long source_brk,
-		unsigned int start_index, unsigned int n_page)
-{
-	int ret = 0;
-	unsigned int i, end_index = start_index + n_page;
-	unsigned int dest_index;
-
-	if (s_table == page_table_0)
-		dest_index = PAGE_KINDEX(source_brk);
-	else
-		dest_index = PAGE_UINDEX(source_brk);
-
-	s_table[dest_index].valid = 1;
-	s_table[dest_index].prot = PROT_READ | PROT_WRITE;
-	for (i = start_index; i < end_index; i++) {
-		struct phy_frame *frame;
-		frame = get_free_frame();
-		if (frame == NULL) {
-			_error("No more physical frames available now!\n");
-			ret = ENOMEM;
-			goto out;
-		}
-
-		record[i - start_index] = frame->index;
-		s_table[dest_index].pfn = frame->index;
-		WriteRegister(REG_TLB_FLUSH, source_brk);
-		if (s_table == page_table_0)
-			memcpy(source_brk, PAGE_KADDR(i), PAGESIZE);
-		else
-			memcpy(source_brk, PAGE_UADDR(i), PAGESIZE);
-		remove_free_frame(frame);
-	}
+	ret = get_free_frames(n_page, record);
+	if (ret)
+		_error("No more physical frames available now!\n");
 
-	bzero(s_table + dest_index, sizeof(struct my_pte));
-	WriteRegister(REG_TLB_FLUSH, source_brk);
-out:
 	return ret;
 }
 
@@ -318,6 +870,9 @@ int update_pages_indexes(struct my_pte *table, unsigned int start_index,
 {
 	int ret = 0;
 	unsigned int i, end_index = start_index + n_page;
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, table);
 	for (i = start_index; i < end_index; i++) {
 		if (!table[i].valid) {
 			_error("%s: page [%d->%u] is invalid, DO NOT touch it!\n",
@@ -325,17 +880,54 @@ int update_pages_indexes(struct my_pte *table, unsigned int start_index,
 			ret = ERROR;
 			goto out;
 		}
+		if (table[i].pfn == indexes[i - start_index]) {
+			tlb_stat.avoided++;
+			continue;
+		}
 		table[i].pfn = indexes[i - start_index];
-		if (table == page_table_0)
-			WriteRegister(REG_TLB_FLUSH, PAGE_KADDR(i));
-		else
-			WriteRegister(REG_TLB_FLUSH, PAGE_UADDR(i));
+		tlb_batch_add(&batch, i);
 	}
 
 out:
+	tlb_batch_commit(&batch);
 	return ret;
 }
 
+/**
+ * point the kernel stack pages of region 0 at another kernel stack.
+ * Entries already mapping the right frame are left alone, the others
+ * are invalidated together with one kernel stack flush where the
+ * hardware has it
+ * @pfns: the frames of the kernel stack, lowest page first
+ */
+unsigned int remap_kernel_stack(unsigned int *pfns)
+{
+	struct my_pte *ptep = page_table_0 + PAGE_KINDEX(KERNEL_STACK_BASE);
+	unsigned int i, n = 0;
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, page_table_0);
+	for (i = 0; i < PAGE_NR(KERNEL_STACK_MAXSIZE); i++) {
+		if (ptep[i].pfn == pfns[i])
+			continue;
+		ptep[i].pfn = pfns[i];
+		tlb_batch_add(&batch, PAGE_KINDEX(KERNEL_STACK_BASE) + i);
+		n++;
+	}
+
+#ifdef TLB_FLUSH_KSTACK
+	if (n) {
+		WriteRegister(REG_TLB_FLUSH, TLB_FLUSH_KSTACK);
+		tlb_stat.full_flushes++;
+		tlb_stat.avoided += n - 1;
+	}
+#else
+	tlb_batch_commit(&batch);
+#endif
+
+	return n;
+}
+
 /**
  * update the property of certain page table entries
  * @table: the page table to be manipulated
@@ -346,6 +938,9 @@ int update_pages_prot(struct my_pte *table, unsigned int start_index, unsigned i
 {
 	int ret = 0;
 	unsigned int i, end_index = start_index + n_page;
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, table);
 	for (i = start_index; i < end_index; i++) {
 		if (!table[i].valid) {
 			_error("%s: page is invalid, DO NOT touch it!\n", __func__);
@@ -353,13 +948,11 @@ int update_pages_prot(struct my_pte *table, unsigned int start_index, unsigned i
 			goto out;
 		}
 		table[i].prot = prot;
-		if (table == page_table_0)
-			WriteRegister(REG_TLB_FLUSH, PAGE_KADDR(i));
-		else
-			WriteRegister(REG_TLB_FLUSH, PAGE_UADDR(i));
+		tlb_batch_add(&batch, i);
 	}
 
 out:
+	tlb_batch_commit(&batch);
 	return ret;
 }
 
@@ -380,11 +973,9 @@ int update_pages_cow(struct my_pte *table, unsigned int start_index, unsigned in
 			ret = ERROR;
 			goto out;
 		}
+		/* cow is a software bit the MMU never looks at,
+		 * so there is no TLB entry to invalidate */
 		table[i].cow = cow;
-		if (table == page_table_0)
-			WriteRegister(REG_TLB_FLUSH, PAGE_KADDR(i));
-		else
-			WriteRegister(REG_TLB_FLUSH, PAGE_UADDR(i));
 	}
 
 out:
@@ -405,27 +996,28 @@ int unmap_pages(struct my_pte *table, unsigned int start_index, unsigned int n_p
 	int ret = 0;
 	unsigned int i, end_index = start_index + n_page;
 	struct my_pte *pte;
+	struct tlb_batch batch;
 
+	tlb_batch_init(&batch, table);
 	for (i = start_index; i < end_index; i++) {
 		pte = table + i;
-#ifdef COW
-		if (!pte->cow) {
-#endif
-			ret = add_free_frame(pte->pfn);
-			if (ret)
-				goto out;
-#ifdef COW
+		if (!pte_resident(pte)) {
+			/* not mapped, or its frame has gone with swap */
+			if (pte->swap)
+				swap_slot_free(pte->pfn);
+			bzero(pte, sizeof(struct my_pte));
+			continue;
 		}
-#endif
+		/* the frame is freed with its last mapping */
+		ret = put_frame(pte->pfn);
+		if (ret)
+			goto out;
 		bzero(pte, sizeof(struct my_pte));
-		if (table == page_table_0)
-			WriteRegister(REG_TLB_FLUSH, PAGE_KADDR(i));
-		else
-			WriteRegister(REG_TLB_FLUSH, PAGE_UADDR(i));
+		tlb_batch_add(&batch, i);
 	}
 
 out:
-	flush_TLB(table);
+	tlb_batch_commit(&batch);
 	return ret;
 }
 
@@ -439,7 +1031,20 @@ out:
 int collect_back_pages(unsigned int *indexes, unsigned int n_page)
 {
 	int ret = 0;
-	unsigned int i;
+	unsigned int i, order = frames_order(n_page);
+
+	/* an aligned contiguous run goes back to the buddy system whole */
+	if (n_page > 1 && n_page == (1U << order) &&
+			!(indexes[0] & (n_page - 1)) &&
+			indexes[0] + n_page <= max_pfn) {
+		for (i = 1; i < n_page; i++)
+			if (indexes[i] != indexes[0] + i)
+				break;
+		if (i == n_page) {
+			free_frames(indexes[0], order);
+			goto out;
+		}
+	}
 
 	for (i = 0; i < n_page; i++) {
 		ret = add_free_frame(indexes[i]);
@@ -0,0 +1,161 @@
+#include <pcache.h>
+#include <page.h>
+#include <hash.h>
+#include <sys.h>
+#include <slab.h>
+#include "internal.h"
+
+static DEFINE_HASHTABLE(pcache_hash_table, PCACHE_HASH_BITS);
+static LIST(pcache_lru);
+static DEFINE_KMEM_CACHE(pcache_page_cache, "pcache_page", struct pcache_page);
+
+struct pcache_stat pcache_stat;
+
+static inline u32 pcache_key(struct vm_file *file, unsigned long offset)
+{
+	return (u32)file->ino ^ (u32)(offset >> PAGESHIFT);
+}
+
+static inline bool pcache_match(struct pcache_page *page,
+				struct vm_file *file, unsigned long offset)
+{
+	return page->ino == file->ino && page->dev == file->dev &&
+		page->mtime == file->mtime && page->offset == offset;
+}
+
+static struct pcache_page *pcache_find(struct vm_file *file,
+				       unsigned long offset)
+{
+	struct pcache_page *page;
+
+	hash_for_each_possible(pcache_hash_table, page, hlist,
+			pcache_key(file, offset))
+		if (pcache_match(page, file, offset))
+			return page;
+
+	return NULL;
+}
+
+static void pcache_remove(struct pcache_page *page)
+{
+	hash_del(&page->hlist);
+	list_del(&page->lru);
+	put_frame(page->pfn);
+	kmem_cache_free(&pcache_page_cache, page);
+	pcache_stat.nr_pages--;
+
+	return;
+}
+
+/**
+ * look up a page of an executable in the cache. On a hit the frame gets
+ * one more reference for the caller to map
+ * @file: the executable
+ * @offset: the file offset of the page
+ * @len: the number of bytes of the page that come from the file
+ * @pfn: where to record the cached frame
+ */
+int pcache_lookup(struct vm_file *file, unsigned long offset,
+		  unsigned long len, unsigned int *pfn)
+{
+	struct pcache_page *page;
+
+	page = pcache_find(file, offset);
+	if (page == NULL || page->len != len) {
+		pcache_stat.misses++;
+		return ERROR;
+	}
+
+	list_del(&page->lru);
+	list_add_tail(&pcache_lru, &page->lru);
+	get_frame(page->pfn);
+	*pfn = page->pfn;
+	pcache_stat.hits++;
+
+	return 0;
+}
+
+/**
+ * keep a page just read from an executable in the cache. The cache takes
+ * its own reference, so the frame outlives the processes mapping it
+ * @file: the executable
+ * @offset: the file offset of the page
+ * @len: the number of bytes of the page that come from the file
+ * @pfn: the frame holding the page
+ */
+int pcache_insert(struct vm_file *file, unsigned long offset,
+		  unsigned long len, unsigned int pfn)
+{
+	struct pcache_page *page;
+
+	page = pcache_find(file, offset);
+	if (page)
+		pcache_remove(page);
+
+	page = kmem_cache_alloc(&pcache_page_cache);
+	if (page == NULL)
+		return ENOMEM;
+	page->dev = file->dev;
+	page->ino = file->ino;
+	page->mtime = file->mtime;
+	page->offset = offset;
+	page->len = len;
+	page->pfn = pfn;
+	get_frame(pfn);
+
+	INIT_LIST_ELM(&page->lru);
+	hash_add(pcache_hash_table, &page->hlist, pcache_key(file, offset));
+	list_add_tail(&pcache_lru, &page->lru);
+	pcache_stat.nr_pages++;
+
+	return 0;
+}
+
+/**
+ * drop the cached copy of a page once nobody else holds its frame, so
+ * that the frame goes back to the free frames
+ * @file: the executable
+ * @offset: the file offset of the page
+ * @pfn: the frame the page was mapped from
+ *
+ * Return 0 if the frame was freed.
+ */
+int pcache_release(struct vm_file *file, unsigned long offset,
+		   unsigned int pfn)
+{
+	struct pcache_page *page;
+
+	page = pcache_find(file, offset);
+	if (page == NULL || page->pfn != pfn || mem_map[pfn].count > 1)
+		return ERROR;
+
+	pcache_remove(page);
+	pcache_stat.evictions++;
+
+	return 0;
+}
+
+/**
+ * give frames back under memory pressure, dropping the least recently
+ * used cached pages nobody maps any more
+ * @n_frame: how many frames are wanted
+ */
+unsigned int pcache_shrink(unsigned int n_frame)
+{
+	struct list_head *pos, *tmp;
+	struct pcache_page *page;
+	unsigned int n = 0;
+
+	list_for_each_safe(pos, tmp, &pcache_lru) {
+		if (n == n_frame)
+			break;
+		page = list_entry(pos, struct pcache_page, lru);
+		if (mem_map[page->pfn].count > 1)
+			continue;
+		pcache_remove(page);
+		pcache_stat.evictions++;
+		n++;
+	}
+
+	return n;
+}
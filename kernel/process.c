@@ -1,8 +1,12 @@
 #include <yalnix.h>
+#include <unistd.h>
 #include <process.h>
 #include <page.h>
 #include <sys.h>
 #include <utility.h>
+#include <swap.h>
+#include <pcache.h>
+#include <slab.h>
 #include "internal.h"
 
 #define INIT_WAIT_QUEUE(q)				\
@@ -16,6 +20,7 @@ struct task_struct *current;
 struct task_struct *tty_writing_tasks[] = { NULL };
 struct task_struct *tty_reading_tasks[] = { NULL };
 DEFINE_HASHTABLE(process_hash_table, PROCESS_HASH_BITS);
+LIST(task_run_list);
 
 struct task_wait_queue {
 	struct list_head head;
@@ -28,6 +33,13 @@ static struct task_wait_queue tty_read_queues[NUM_TERMINALS];
 static unsigned long time_slice;
 static unsigned long rr_timeout;
 
+struct stack_stat stack_stat = { 0, 0, 0, 0 };
+struct kstack_stat kstack_stat = { 0, 0, 0 };
+struct switch_stat switch_stat = { 0, 0, 0, 0, 0 };
+
+static DEFINE_KMEM_CACHE(task_cache, "task_struct", struct task_struct);
+static DEFINE_KMEM_CACHE(zombie_cache, "zombie", struct zombie_task_struct);
+
 
 /**
  * allocate and init a child process
@@ -37,7 +49,7 @@ struct task_struct *alloc_and_init_task(struct task_struct *parent)
 {
 	struct task_struct *task;
 
-	task = (void *)calloc(1, sizeof(struct task_struct));
+	task = kmem_cache_alloc(&task_cache);
 	if (task == NULL)
 		return NULL;
 
@@ -48,20 +60,68 @@ struct task_struct *alloc_and_init_task(struct task_struct *parent)
 	INIT_LIST_ELM(&task->child_link);
 	INIT_LIST_ELM(&task->wait_list);
 	INIT_LIST_HEAD(&task->zombie_head);
-#ifdef COW
-	INIT_LIST_HEAD(&task->cow_list);
-#endif
+	INIT_LIST_HEAD(&task->mmap);
 	task->exit_code = 0;
 	task->tty_buf = NULL;
+	bzero(task->utilities, sizeof(task->utilities));
 	bzero(task->stack_phy_pages, sizeof(task->stack_phy_pages));
 	task->page_table = NULL;
+	task->clock_hand = 0;
+	task->rss = 0;
+	task->ra_next = 0;
+	task->ra_window = 1;
+	task->reclaim_round = 0;
+	task->swap_outs = 0;
 
 	INIT_HLIST_NODE(&task->hlist);
 	hash_add(process_hash_table, &task->hlist, task->pid);
+	task->last_run = jiffies;
+	list_add_tail(&task_run_list, &task->run_link);
 
 	return task;
 }
 
+/**
+ * find the first area of a task having any of @flags
+ * @task: the task to be looked up
+ * @flags: VM_* flags to look for
+ */
+struct vm_area_struct *task_vma(struct task_struct *task,
+			      unsigned int flags)
+{
+	return vma_find_flags(&task->mmap, flags);
+}
+
+/*
+ * resident pages of a task in [@start, @start + @n_page), not counting
+ * the shared zero frame
+ */
+static unsigned int task_range_rss(struct task_struct *task,
+				   unsigned int start, unsigned int n_page)
+{
+	unsigned int i, n = 0;
+	struct my_pte *ptep;
+
+	for (i = start; i < start + n_page; i++) {
+		ptep = task->page_table + i;
+		if (pte_resident(ptep) && ptep->pfn != zero_frame)
+			n++;
+	}
+
+	return n;
+}
+
+/*
+ * unmap pages of a task, keeping its resident page count right
+ */
+static int task_unmap_pages(struct task_struct *task, unsigned int start,
+			    unsigned int n_page)
+{
+	task->rss -= task_range_rss(task, start, n_page);
+
+	return unmap_pages(task->page_table, start, n_page);
+}
+
 /**
  * copy a process' address space to another
  * @dest: the process to be copied to
@@ -69,10 +129,16 @@ struct task_struct *alloc_and_init_task(struct task_struct *parent)
  */
 int task_vm_copy(struct task_struct *dest, struct task_struct *source)
 {
-	unsigned int page_index_start, page_index_end, i;
+	unsigned int i;
 	struct my_pte *page_table;
+	struct vm_area_struct *vma;
+	struct tlb_batch batch;
 	int ret = 0;
 
+	/* the child gets copies of resident pages only */
+	if (swap_in(source))
+		return EIO;
+
 	page_table = (void *)calloc(PAGE_NR(VMEM_1_SIZE),
 					sizeof(struct my_pte));
 	if (page_table == NULL) {
@@ -80,68 +146,99 @@ int task_vm_copy(struct task_struct *dest, struct task_struct *source)
 		return ENOMEM;
 	}
 
-#ifdef COW
-	for (i = 0; i < PAGE_NR(VMEM_1_SIZE); i++) {
-		page_table[i] = source->page_table[i];
-		/* change WR pages to read-only */
-		if (page_table[i].prot == (PROT_READ | PROT_WRITE)) {
-			update_pages_prot(page_table, i, 1, PROT_READ);
-			update_pages_prot(source->page_table, i, 1, PROT_READ);
-		}
-		/* mark page table entries to cow */
-		if (page_table[i].valid) {
-			update_pages_cow(page_table, i, 1, 1);
-			update_pages_cow(source->page_table, i, 1, 1);
-		}
-	}
-
-	list_add(&source->cow_list, &dest->cow_list);
-#else
-	/* allocate and copy address space for user text */
-	ret = map_pages_and_copy(page_table, source->page_table, source->brk,
-			source->code_start, source->code_pgn);
-	if (ret) {
-		_error("%s: map pages for text segment \
-				from pid(%u) to pid(u) error!\n",
-				source->pid, dest->pid);
-		return ret;
-	}
-	/* update prot for user text segment */
-	ret = update_pages_prot(page_table, source->code_start,
-			source->code_pgn, PROT_READ | PROT_EXEC);
+	ret = vma_copy(&dest->mmap, &source->mmap);
 	if (ret) {
-		_error("%s: map pages for text segment \
-				from pid(%u) to pid(u) error!\n",
-				source->pid, dest->pid);
+		_error("%s: vm areas memory out!\n", __func__);
+		free(page_table);
 		return ret;
 	}
+	/* from here on a failed copy is torn down with the child */
+	dest->page_table = page_table;
 
-	/* allocate and copy address space for user data segment */
-	ret = map_pages_and_copy(page_table, source->page_table, source->brk,
-			source->data_start,
-			PAGE_UINDEX(source->brk) - source->data_start);
-	if (ret) {
-		_error("%s: map pages for data segment \
-				from pid(%u) to pid(u) error!\n",
-				source->pid, dest->pid);
-		return ret;
+#ifdef COW
+	/* the child's page table is not loaded, so only the source's
+	 * entries need TLB invalidation and they are flushed at once */
+	tlb_batch_init(&batch, source->page_table);
+	vma_for_each(vma, &source->mmap) {
+		for (i = vma->start; i < vma->end; i++) {
+			struct my_pte *ptep = source->page_table + i;
+
+			if (!pte_resident(ptep)) {
+				page_table[i] = *ptep;
+				continue;
+			}
+
+			/* change private WR pages to read-only cow pages */
+			if (!(vma->flags & VM_SHARED) &&
+					ptep->prot == (PROT_READ | PROT_WRITE)) {
+				ptep->prot = PROT_READ;
+				ptep->cow = 1;
+				tlb_batch_add(&batch, i);
+			}
+			get_frame(ptep->pfn);
+			page_table[i] = *ptep;
+		}
 	}
+	tlb_batch_commit(&batch);
+#else
+	vma_for_each(vma, &source->mmap) {
+		/* allocate and copy address space for the area */
+		ret = map_pages_and_copy(page_table, source->page_table,
+				vma->start, vma_pgn(vma));
+		if (ret) {
+			_error("%s: map pages for area [%u, %u) \
+					from pid(%u) to pid(%u) error!\n",
+					__func__, vma->start, vma->end,
+					source->pid, dest->pid);
+			return ret;
+		}
 
-	/* allocate and copy address space for user stack */
-	ret = map_pages_and_copy(page_table, source->page_table, source->brk,
-			source->stack_start, source->stack_pgn);
-	if (ret) {
-		_error("%s: map pages for stack\
-				from pid(%u) to pid(u) error!\n",
-				source->pid, dest->pid);
-		return ret;
+		/* update prot for read-only areas like user text */
+		if (vma->prot == (PROT_READ | PROT_WRITE))
+			continue;
+		for (i = vma->start; i < vma->end; i++) {
+			if (!page_table[i].valid)
+				continue;
+			ret = update_pages_prot(page_table, i, 1, vma->prot);
+			if (ret)
+				return ret;
+		}
 	}
 #endif
 
-	dest->page_table = page_table;
+	dest->rss = source->rss;
 	return ret;
 }
 
+/*
+ * make every page of the areas to be shared resident and privately
+ * owned by the source, writable where the area is: a page left to
+ * demand paging, or still copy-on-write, would be faulted in or broken
+ * off separately by each process. Retained heap pages above the break
+ * are given back first, they are no part of the heap to share
+ */
+static int task_vm_share_prepare(struct task_struct *source)
+{
+	struct vm_area_struct *vma;
+	bool write;
+	int ret;
+
+	task_heap_trim(source, 0);
+
+	vma_for_each(vma, &source->mmap) {
+		if (vma->flags & VM_STACK || vma_pgn(vma) == 0)
+			continue;
+		write = (vma->prot & PROT_WRITE) != 0;
+		ret = task_vm_prefault(source, (void *)PAGE_UADDR(vma->start),
+				vma_pgn(vma) << PAGESHIFT, write);
+		if (ret)
+			return ret;
+		vma->flags |= VM_SHARED;
+	}
+
+	return 0;
+}
+
 /**
  * copy a process' address to another and make the text segment,
  * data segment and heap segment sharing with each other
@@ -150,40 +247,128 @@ int task_vm_copy(struct task_struct *dest, struct task_struct *source)
  */
 int task_vm_share_copy(struct task_struct *dest, struct task_struct *source)
 {
-	unsigned int page_index_start, page_index_end, i;
+	unsigned int i;
 	struct my_pte *page_table;
+	struct vm_area_struct *vma;
 	int ret = 0;
 
+	/* the child gets copies of resident pages only */
+	if (swap_in(source))
+		return EIO;
+
+	ret = task_vm_share_prepare(source);
+	if (ret) {
+		_error("%s: faulting in shared areas of pid(%u) failed!\n",
+				__func__, source->pid);
+		return ret;
+	}
+
 	page_table = (void *)calloc(PAGE_NR(VMEM_1_SIZE), sizeof(struct my_pte));
 	if (page_table == NULL) {
 		_error("%s: page table memory out!\n", __func__);
 		return ENOMEM;
 	}
 
-	for (i = 0; i < source->stack_start; i++) {
-		page_table[i] = source->page_table[i];
-		if (page_table[i].valid) {
-			update_pages_cow(page_table, i, 1, 1);
-			update_pages_cow(source->page_table, i, 1, 1);
+	ret = vma_copy(&dest->mmap, &source->mmap);
+	if (ret) {
+		_error("%s: vm areas memory out!\n", __func__);
+		free(page_table);
+		return ret;
+	}
+	/* from here on a failed copy is torn down with the child */
+	dest->page_table = page_table;
+
+	vma_for_each(vma, &dest->mmap) {
+		if (!(vma->flags & VM_SHARED))
+			continue;
+		for (i = vma->start; i < vma->end; i++) {
+			if (pte_resident(source->page_table + i))
+				get_frame(source->page_table[i].pfn);
+			page_table[i] = source->page_table[i];
 		}
 	}
 
 	/* allocate and copy address space for user stack */
-	ret = map_pages_and_copy(page_table, source->page_table, source->brk,
-			source->stack_start, source->stack_pgn);
+	vma = task_vma(source, VM_STACK);
+	ret = map_pages_and_copy(page_table, source->page_table,
+			vma->start, vma_pgn(vma));
 	if (ret) {
 		_error("%s: map pages for stack\
-				from pid(%u) to pid(u) error!\n",
-				source->pid, dest->pid);
+				from pid(%u) to pid(%u) error!\n",
+				__func__, source->pid, dest->pid);
 		return ret;
 	}
 
-	list_add(&source->cow_list, &dest->cow_list);
-	dest->page_table = page_table;
+	vma_for_each(vma, &dest->mmap)
+		dest->rss += task_range_rss(dest, vma->start, vma_pgn(vma));
 
 	return ret;
 }
 
+/**
+ * give back the heap pages a task keeps mapped above its break
+ * @task: the task
+ * @keep: how many of the retained pages may stay
+ *
+ * Return the number of frames freed.
+ */
+unsigned int task_heap_trim(struct task_struct *task, unsigned int keep)
+{
+	unsigned int i, start, n = 0;
+	struct vm_area_struct *heap;
+
+	heap = task_vma(task, VM_HEAP);
+	if (heap == NULL)
+		return 0;
+
+	start = PAGE_UINDEX(task->brk) + keep;
+	if (heap->end <= start)
+		return 0;
+
+	for (i = start; i < heap->end; i++) {
+		struct my_pte *ptep = task->page_table + i;
+
+		if (pte_resident(ptep) && mem_map[ptep->pfn].count == 1)
+			n++;
+	}
+	task_unmap_pages(task, start, heap->end - start);
+	heap->end = start;
+
+	return n;
+}
+
+/**
+ * hand retained heap pages out again when the break grows back over
+ * them. They read as zeros like fresh heap pages: a private frame is
+ * cleared in place, anything else goes back to demand-zero. A cleared
+ * frame no longer matches the swap slot it may have been read from
+ * @task: the task
+ * @start_index: the first page to be reused
+ * @end_index: one past the last page to be reused
+ */
+void task_heap_reuse(struct task_struct *task, unsigned int start_index,
+		     unsigned int end_index)
+{
+	unsigned int i;
+	struct my_pte *ptep;
+
+	for (i = start_index; i < end_index; i++) {
+		ptep = task->page_table + i;
+		if (pte_resident(ptep)) {
+			if (ptep->pfn == zero_frame)
+				continue;
+			if (mem_map[ptep->pfn].count == 1 &&
+					clear_frame(ptep->pfn) == 0) {
+				swap_cache_release(ptep->pfn);
+				continue;
+			}
+		}
+		task_unmap_pages(task, i, 1);
+	}
+
+	return;
+}
+
 /**
  * expand a task's stack
  * @task: the task to be expaned
@@ -192,47 +377,304 @@ int task_vm_share_copy(struct task_struct *dest, struct task_struct *source)
 void task_vm_expand_stack(struct task_struct *task, int increment)
 {
 	unsigned int new_stack_start;
+	struct vm_area_struct *stack;
 
 	if (task == NULL || increment == 0)
 		return;
 
-	new_stack_start = task->stack_start - increment;
+	stack = task_vma(task, VM_STACK);
+	if (stack == NULL)
+		return;
+
+	new_stack_start = stack->start - increment;
 	if (new_stack_start <= PAGE_UINDEX(task->brk) ||
-			new_stack_start >= PAGE_UINDEX(VMEM_1_LIMIT))
+			new_stack_start >= stack->end)
 		return;
 
-	if (increment > 0)
-		map_pages(task->page_table, new_stack_start, increment,
-				PROT_READ | PROT_WRITE);
-	else
-		unmap_pages(task->page_table, task->stack_start, -increment);
+	if (increment > 0) {
+		/* the stack wins over heap pages retained above the break */
+		task_heap_trim(task, 0);
+		if (map_zeroed_pages(task->page_table, new_stack_start,
+					increment, stack->prot) == 0)
+			task->rss += increment;
+		task->stack_low = min(task->stack_low, new_stack_start);
+		stack_stat.grows++;
+		stack_stat.grow_pages += increment;
+	} else {
+		task_unmap_pages(task, stack->start, -increment);
+		stack_stat.shrinks++;
+		stack_stat.shrink_pages += -increment;
+	}
 
-	task->stack_start -= increment;
-	task->stack_pgn += increment;
+	stack->start = new_stack_start;
 
 	return;
 }
 
+/*
+ * start a new period of watching how deep a task's stack goes
+ */
+static inline void task_stack_watch(struct task_struct *task,
+				    unsigned int sp_index)
+{
+	task->stack_low = sp_index;
+	task->stack_since = jiffies;
+
+	return;
+}
+
+/**
+ * shrink a task's stack lazily. The lowest stack pointer seen at the
+ * task's trips through the scheduler is tracked, and only the pages
+ * below it are given back once STACK_SHRINK_DELAY ticks have passed,
+ * so recursion going up and down does not fault the same pages back in
+ * @task: the task
+ * @sp: the user stack pointer of the task
+ */
+void task_stack_update(struct task_struct *task, void *sp)
+{
+	unsigned int sp_index = PAGE_UINDEX(sp);
+	struct vm_area_struct *stack;
+
+	stack = task_vma(task, VM_STACK);
+	if (stack == NULL)
+		return;
+
+	task->stack_low = min(task->stack_low, sp_index);
+	if (jiffies - task->stack_since < STACK_SHRINK_DELAY)
+		return;
+
+	if (task->stack_low > stack->start)
+		task_vm_expand_stack(task, stack->start - task->stack_low);
+	task_stack_watch(task, sp_index);
+
+	return;
+}
+
+/**
+ * give back the stack pages below the saved stack pointer of a task
+ * which is not running, on memory pressure
+ * @task: the task
+ *
+ * Return the number of frames freed.
+ */
+unsigned int task_stack_trim(struct task_struct *task)
+{
+	unsigned int i, sp_index, n = 0;
+	struct vm_area_struct *stack;
+
+	/* a child which has never run has no saved context of its own */
+	stack = task_vma(task, VM_STACK);
+	if (stack == NULL || task == current || task->stack_phy_pages[0] == 0)
+		return 0;
+
+	sp_index = PAGE_UINDEX(task->ucontext.sp);
+	if (sp_index <= stack->start || sp_index >= stack->end)
+		return 0;
+
+	for (i = stack->start; i < sp_index; i++) {
+		struct my_pte *ptep = task->page_table + i;
+
+		if (pte_resident(ptep) && mem_map[ptep->pfn].count == 1)
+			n++;
+	}
+	task_vm_expand_stack(task, stack->start - sp_index);
+	task_stack_watch(task, sp_index);
+
+	return n;
+}
+
+/*
+ * bring a page of a file-backed area in. Pages already in the page cache
+ * are mapped shared, read-only text as it is and writable data
+ * copy-on-write. Otherwise the page is read through its user address,
+ * so the task's page table has to be the one in REG_PTBR1
+ */
+static int task_vm_file_fault(struct task_struct *task,
+			      struct vm_area_struct *vma,
+			      unsigned int page_index)
+{
+	unsigned long pos = (unsigned long)(page_index - vma->start)
+				<< PAGESHIFT;
+	void *addr = (void *)PAGE_UADDR(page_index);
+	struct my_pte *ptep = task->page_table + page_index;
+	int prot = vma->prot, cow = 0;
+	bool shared = true;
+	unsigned int pfn;
+	long len = 0;
+	int ret;
+
+	if (pos < vma->file_size)
+		len = min(vma->file_size - pos, (unsigned long)PAGESIZE);
+
+	if (prot & PROT_WRITE) {
 #ifdef COW
+		prot = PROT_READ;
+		cow = 1;
+#else
+		shared = false;
+#endif
+	}
+
+	if (shared && pcache_lookup(vma->file, vma->offset + pos, len,
+				&pfn) == 0)
+		return map_shared_page(task->page_table, page_index, pfn,
+				prot, cow);
+
+	ret = map_pages(task->page_table, page_index, 1,
+			PROT_READ | PROT_WRITE);
+	if (ret)
+		return ret;
+
+	if (len && pread(vma->file->fd, addr, len, vma->offset + pos) != len) {
+		_error("Reading page %u of \"%s\" failed!\n",
+				page_index, vma->file->path);
+		unmap_pages(task->page_table, page_index, 1);
+		return EIO;
+	}
+	bzero(addr + len, PAGESIZE - len);
+
+	if (!shared)
+		return 0;
+
+	pcache_insert(vma->file, vma->offset + pos, len, ptep->pfn);
+	update_pages_prot(task->page_table, page_index, 1, prot);
+	ptep->cow = cow;
+
+	return 0;
+}
+
 /**
- * assign a separate page copy to each process who is sharing this page
- * @task: any one of the processes who are sharing this page
+ * handle a fault on a page which is not mapped. A resident page sampled
+ * by the clock hand is just marked referenced again. A page of the
+ * executable is read in from the file the first time it is touched. An
+ * untouched page of an anonymous area is mapped read-only to the zero
+ * frame, and gets its own zeroed frame on the first write
+ * @task: the faulting task
+ * @page_index: the faulting page
+ */
+int task_vm_fault(struct task_struct *task, unsigned int page_index)
+{
+	struct vm_area_struct *vma;
+	int ret;
+
+	vma = vma_find(&task->mmap, page_index);
+	if (vma == NULL)
+		return ERROR;
+
+	/* the heap ends at the break, whatever is retained above it */
+	if ((vma->flags & VM_HEAP) && page_index >= PAGE_UINDEX(task->brk))
+		return ERROR;
+
+	/* referenced again after the clock hand sampled it */
+	if (pte_sampled(task->page_table + page_index)) {
+		task->page_table[page_index].valid = 1;
+		task->page_table[page_index].ref = 1;
+		return 0;
+	}
+
+	if (vma->file) {
+		ret = task_vm_file_fault(task, vma, page_index);
+	} else {
+		if (!(vma->flags & VM_ANON))
+			return ERROR;
+#ifdef COW
+		ret = map_zero_pages(task->page_table, page_index, 1);
+#else
+		ret = map_zeroed_pages(task->page_table, page_index, 1,
+				vma->prot);
+#endif
+	}
+	if (ret == 0 && task->page_table[page_index].pfn != zero_frame)
+		task->rss++;
+
+	return ret;
+}
+
+/**
+ * make sure a user buffer is mapped, resident and (if @write) privately
+ * writable before the kernel touches it on behalf of the task
+ * @task: the task owning the buffer
+ * @addr: the start address of the buffer
+ * @len: the length of the buffer
+ * @write: whether the kernel is going to write the buffer
+ */
+int task_vm_prefault(struct task_struct *task, void *addr, size_t len,
+		     bool write)
+{
+	unsigned int i, start_index, end_index;
+	struct my_pte *ptep;
+
+	if (len == 0)
+		return 0;
+
+	start_index = PAGE_UINDEX(addr);
+	end_index = min(PAGE_UINDEX((unsigned long)addr + len - 1) + 1,
+			PAGE_NR(VMEM_1_SIZE));
+	for (i = start_index; i < end_index; i++) {
+		ptep = task->page_table + i;
+		if (ptep->swap && swap_in_page(task, i))
+			return EIO;
+		if (!ptep->valid && task_vm_fault(task, i))
+			return ERROR;
+#ifdef COW
+		if (write && ptep->cow && ptep->prot == PROT_READ &&
+				task_cow_copy_page(task, i))
+			return ENOMEM;
+#endif
+	}
+
+	return 0;
+}
+
+/**
+ * prefault a NUL terminated user string page by page, as its length is
+ * only known once the pages holding it are resident
+ * @task: the task owning the string
+ * @str: the user address of the string
+ */
+int task_vm_prefault_string(struct task_struct *task, char *str)
+{
+	char *page_end;
+
+	while (1) {
+		if (task_vm_prefault(task, str, 1, false))
+			return ERROR;
+		page_end = (char *)UP_TO_PAGE((unsigned long)str + 1);
+		for (; str < page_end; str++)
+			if (*str == '\0')
+				return 0;
+	}
+}
+
+#ifdef COW
+/**
+ * break copy-on-write of a page for the faulting task only. If nobody
+ * else maps the frame any more, the page just becomes writable again
+ * @task: the task who wrote the shared page
  * @page_index: the page which is being shared
  */
 int task_cow_copy_page(struct task_struct *task, unsigned int page_index)
 {
-	struct list_head *list;
-	struct task_struct *cow_task;
-	list_for_each(list, &task->cow_list) {
-		cow_task = list_entry(list, struct task_struct, cow_list);
-		page_cow_copy(cow_task->page_table, task->page_table,
-				task->brk, page_index);
+	struct my_pte *ptep = task->page_table + page_index;
+	int ret = 0;
+
+	if (mem_map[ptep->pfn].count > 1) {
+		bool zero = ptep->pfn == zero_frame;
+
+		ret = page_cow_copy(task->page_table, page_index);
+		if (ret)
+			return ret;
+		if (zero)
+			task->rss++;
+	} else {
+		update_pages_prot(task->page_table, page_index, 1,
+				PROT_READ | PROT_WRITE);
+		update_pages_cow(task->page_table, page_index, 1, 0);
+		ptep->dirty = 1;
 	}
-	update_pages_prot(task->page_table, page_index, 1,
-			PROT_READ | PROT_WRITE);
-	update_pages_cow(task->page_table, page_index, 1, 0);
 
-	return 0;
+	return ret;
 }
 #endif
 
@@ -286,26 +728,118 @@ void inline task_info_parent(struct task_struct *parent, int exit_code)
  */
 void inline task_address_space_unmap(struct task_struct *task)
 {
-#ifdef COW
-	/* If it is the only one in the cow list, clear all the cow flag
-	 * in its page table, so that to really free the physical frames */
-	if (list_empty(&task->cow_list)) {
-		update_pages_cow(task->page_table, task->code_start,
-				task->code_pgn, 0);
-		update_pages_cow(task->page_table, task->data_start,
-				PAGE_UINDEX(task->brk) - task->data_start, 0);
-		update_pages_cow(task->page_table, task->stack_start,
-				task->stack_pgn, 0);
+	struct vm_area_struct *vma;
+
+	vma_for_each(vma, &task->mmap)
+		task_unmap_pages(task, vma->start, vma_pgn(vma));
+	vma_free_all(&task->mmap);
+
+	return;
+}
+
+/* kernel stacks of exited processes, kept for the next fork */
+static struct kstack_pool {
+	unsigned int pages[KSTACK_POOL_MAX][KSTACK_NPG];
+	unsigned int n;
+} kstack_pool;
+
+/*
+ * get the frames of a kernel stack. On failure no frame is kept and the
+ * record is left empty
+ */
+static inline int kstack_alloc(unsigned int *pages)
+{
+	int ret;
+
+	if (kstack_pool.n) {
+		memcpy(pages, kstack_pool.pages[--kstack_pool.n],
+				sizeof(kstack_pool.pages[0]));
+		kstack_stat.reused++;
+		return 0;
 	}
-#endif
-	unmap_pages(task->page_table, task->code_start, task->code_pgn);
-	unmap_pages(task->page_table, task->data_start,
-			PAGE_UINDEX(task->brk) - task->data_start);
-	unmap_pages(task->page_table, task->stack_start, task->stack_pgn);
 
-#ifdef COW
-	list_del_init(&task->cow_list);
-#endif
+	/* get_free_pages() gives back what it got when it fails */
+	ret = get_free_pages(pages, KSTACK_NPG);
+	if (ret) {
+		bzero(pages, KSTACK_NPG * sizeof(unsigned int));
+		return ret;
+	}
+	kstack_stat.allocated++;
+
+	return 0;
+}
+
+/*
+ * recycle the frames of a kernel stack, an empty record (a child which
+ * never got its stack) holds nothing
+ */
+static inline void kstack_free(unsigned int *pages)
+{
+	if (pages[0] == 0)
+		return;
+
+	if (kstack_pool.n < KSTACK_POOL_MAX) {
+		memcpy(kstack_pool.pages[kstack_pool.n++], pages,
+				sizeof(kstack_pool.pages[0]));
+		return;
+	}
+
+	collect_back_pages(pages, KSTACK_NPG);
+
+	return;
+}
+
+/**
+ * give a task a kernel stack holding a copy of the current one. Only the
+ * live part from @sp up to the top of the stack is copied, what lies
+ * below it is garbage nobody is going to return to
+ * @task: the task getting the kernel stack
+ * @sp: the lowest address in use on the current kernel stack
+ */
+int task_kstack_clone(struct task_struct *task, void *sp)
+{
+	unsigned int i, first, offset;
+	struct my_pte *ptep = page_table_0 + PAGE_KINDEX(KERNEL_STACK_BASE);
+	int ret;
+
+	ret = kstack_alloc(task->stack_phy_pages);
+	if (ret) {
+		_error("Allocating kernel stack for %u failed!\n", task->pid);
+		return ret;
+	}
+
+	first = PAGE_KINDEX(sp) - PAGE_KINDEX(KERNEL_STACK_BASE);
+	offset = (unsigned long)sp & PAGEOFFSET;
+	for (i = first; i < KSTACK_NPG; i++, offset = 0) {
+		ret = copy_frame_from(task->stack_phy_pages[i], ptep[i].pfn,
+				offset);
+		if (ret) {
+			_error("Copying kernel stack for %u failed!\n",
+					task->pid);
+			kstack_free(task->stack_phy_pages);
+			bzero(task->stack_phy_pages,
+					sizeof(task->stack_phy_pages));
+			return ret;
+		}
+		kstack_stat.bytes_copied += PAGESIZE - offset;
+	}
+
+	return 0;
+}
+
+/**
+ * undo a fork which failed before the child ever ran, together with
+ * whatever of its address space got copied
+ * @child: the child created by alloc_and_init_task()
+ */
+void task_fork_abort(struct task_struct *child)
+{
+	list_del(&child->child_link);
+	list_del(&child->run_link);
+	hash_del(&child->hlist);
+	if (child->page_table == NULL)
+		vma_free_all(&child->mmap);
+	free_task(child);
 
 	return;
 }
@@ -320,16 +854,15 @@ void free_task(struct task_struct *task)
 		/* unmap user page table */
 		task_address_space_unmap(task);
 
-		/* unmap kernel stack */
-		collect_back_pages(task->stack_phy_pages,
-				PAGE_NR(KERNEL_STACK_MAXSIZE));
+		/* recycle kernel stack */
+		kstack_free(task->stack_phy_pages);
 		/* put utilities owned by this process */
 		for (i = 0; i < ARRAY_SIZE(task->utilities); i++)
 			if (task->utilities[i])
 				utility_put(task->utilities[i]);
 		free(task->tty_buf);
 		free(task->page_table);
-		free(task);
+		kmem_cache_free(&task_cache, task);
 	}
 
 	return;
@@ -339,7 +872,7 @@ struct zombie_task_struct *task_alloc_zombie(struct task_struct *task)
 {
 	struct zombie_task_struct *zombie;
 
-	zombie = (void *)calloc(1, sizeof(struct zombie_task_struct));
+	zombie = kmem_cache_alloc(&zombie_cache);
 	if (zombie == NULL)
 		goto out;
 
@@ -353,14 +886,14 @@ out:
 
 inline void free_zombie(struct zombie_task_struct *zombie)
 {
-	if (zombie)
-		free(zombie);
+	kmem_cache_free(&zombie_cache, zombie);
 
 	return;
 }
 
 /*
- * the idle process whose pid is 0
+ * the idle process whose pid is 0. It runs in user mode, so the frames
+ * it has time for are zeroed from the clock trap while it is current
  */
 static void do_idle(void)
 {
@@ -381,7 +914,8 @@ static inline void init_idle_task()
 	idle_task.ucontext.sp = (void *)_kstack_base;
 	idle_task.ucontext.ebp = (void *)_kstack_base;
 	idle_task.state = TASK_READY;
-	
+	INIT_LIST_HEAD(&idle_task.mmap);
+
 	return;
 }
 
@@ -394,11 +928,10 @@ static inline void init_init_task()
 	INIT_LIST_ELM(&init_task.child_link);
 	INIT_LIST_ELM(&init_task.wait_list);
 	INIT_LIST_HEAD(&init_task.zombie_head);
-#ifdef COW
-	INIT_LIST_HEAD(&init_task.cow_list);
-#endif
+	INIT_LIST_HEAD(&init_task.mmap);
 	init_task.wait_child_flag = false;
 	init_task.pid = 1;
+	init_task.heap_retain = HEAP_RETAIN_DEFAULT;
 
 	for (i = 0; i < PAGE_NR(KERNEL_STACK_MAXSIZE); i++)
 		init_task.stack_phy_pages[i] =
@@ -406,6 +939,7 @@ static inline void init_init_task()
 
 	INIT_HLIST_NODE(&init_task.hlist);
 	hash_add(process_hash_table, &init_task.hlist, init_task.pid);
+	list_add_tail(&task_run_list, &init_task.run_link);
 
 	return;
 }
@@ -485,28 +1019,66 @@ inline void ready_enqueue(struct task_struct *task)
 	return;
 }
 
+/*
+ * take the first ready task whose memory is resident. A task that would
+ * fault on swap right away is passed over while there is another one to
+ * run, it is being swapped in meanwhile. Idle runs only if nobody else
+ * is ready
+ */
 static struct task_struct *ready_dequeue()
 {
-	struct task_struct *task;
+	struct task_struct *task, *first = NULL;
 	struct list_head *list;
+	unsigned int n_swapped = 0;
 
 	if (list_empty(TO_LIST(&ready_queue)))
-		task = NULL;
-	else {
-repick:
-		list = list_first(TO_LIST(&ready_queue));
+		return NULL;
+
+	list_for_each(list, TO_LIST(&ready_queue)) {
 		task = list_entry(list, struct task_struct, wait_list);
-		list_del(list);
-		ready_queue.n--;
-		if (task == &idle_task && ready_queue.n) {
-			ready_enqueue(task);
-			goto repick;
+		if (task == &idle_task)
+			continue;
+		if (!task_swapped(task)) {
+			/* only now have the swapped ones been passed over */
+			swap_stat.passed_over += n_swapped;
+			goto out;
 		}
+		if (first == NULL)
+			first = task;
+		n_swapped++;
 	}
 
+	task = first ? first : &idle_task;
+out:
+	list_del(&task->wait_list);
+	ready_queue.n--;
+
 	return task;
 }
 
+/**
+ * swap in the tasks at the head of the ready queue before they are
+ * dispatched, a few per clock tick
+ */
+void ready_queue_swap_ahead(void)
+{
+	struct task_struct *task;
+	struct list_head *list;
+	unsigned int n = 0;
+
+	list_for_each(list, TO_LIST(&ready_queue)) {
+		if (n == SWAP_AHEAD_DEPTH)
+			break;
+		task = list_entry(list, struct task_struct, wait_list);
+		if (task == &idle_task)
+			continue;
+		swap_in_ahead(task);
+		n++;
+	}
+
+	return;
+}
+
 inline void ready_queue_insert(struct task_struct *task)
 {
 	task_queue_insert(&ready_queue, task);
@@ -632,6 +1204,7 @@ static KernelContext *kernel_context_switch(KernelContext *kernel_ctx,
 						void *a, void *b)
 {
 	struct task_struct *curr_task, *next_task;
+	unsigned int n;
 
 	curr_task = a;
 	next_task = b;
@@ -644,24 +1217,51 @@ static KernelContext *kernel_context_switch(KernelContext *kernel_ctx,
 	if (curr_task->state != TASK_ZOMBIE)
 		curr_task->kcontext = *kernel_ctx;
 
-	next_task->state = TASK_RUNNING;
-	current = next_task;
+	/* keep task_run_list ordered by when tasks last ran */
+	if (curr_task->state != TASK_ZOMBIE && curr_task != &idle_task) {
+		curr_task->last_run = jiffies;
+		list_del(&curr_task->run_link);
+		list_add_tail(&task_run_list, &curr_task->run_link);
+	}
 
 	/* fork child case */
 	if (next_task->stack_phy_pages[0] == 0) {
 		_debug("\tChild kernel context switching...\n");
 		next_task->ucontext = curr_task->ucontext;
 		next_task->kcontext = curr_task->kcontext;
-		get_free_pages_and_copy(next_task->stack_phy_pages,
-				page_table_0, _kbrk,
-				PAGE_KINDEX(KERNEL_STACK_BASE),
-				PAGE_NR(KERNEL_STACK_MAXSIZE));
+		if (task_kstack_clone(next_task, &curr_task)) {
+			/* the child can not run without a kernel stack, so the
+			 * fork fails and the parent stays on its own stack */
+			if (curr_task->state == TASK_READY) {
+				list_del(&curr_task->wait_list);
+				ready_queue.n--;
+			}
+			curr_task->state = TASK_RUNNING;
+			curr_task->exit_code = ENOMEM;
+			task_fork_abort(next_task);
+			return kernel_ctx;
+		}
+	}
+
+	next_task->state = TASK_RUNNING;
+	current = next_task;
+
+	n = remap_kernel_stack(next_task->stack_phy_pages);
+	if (n)
+		switch_stat.kstack_pages += n;
+	else
+		switch_stat.kstack_kept++;
+	switch_stat.switches++;
+	if (switch_stat.last_jiffies != jiffies) {
+		switch_stat.last_jiffies = jiffies;
+		switch_stat.tick_switches = 0;
 	}
+	switch_stat.tick_switches++;
 
-	update_pages_indexes(page_table_0,
-			PAGE_KINDEX(KERNEL_STACK_BASE),
-			PAGE_NR(KERNEL_STACK_MAXSIZE),
-			next_task->stack_phy_pages);
+	/* load the next address space before a zombie is torn down, so that
+	 * unmapping the zombie's page table needs no TLB flush */
+	if (next_task != &idle_task)
+		UPDATE_VM1_AND_FLUSH_TLB(next_task->page_table);
 
 	if (curr_task->state == TASK_ZOMBIE)
 		free_task(curr_task);
@@ -685,8 +1285,6 @@ __context_switch(struct task_struct *task, struct user_context *user_ctx)
 
 	set_current_state(TASK_RUNNING);
 	*user_ctx = current->ucontext;
-	if (current != &idle_task)
-		UPDATE_VM1_AND_FLUSH_TLB(current->page_table);
 
 	return;
 }
@@ -698,10 +1296,8 @@ void schedule(struct user_context *user_ctx)
 {
 	struct task_struct *task;
 
-	/* shrink stack here */
-	if (PAGE_UINDEX(user_ctx->sp) > current->stack_start)
-		task_vm_expand_stack(current, current->stack_start -
-				PAGE_UINDEX(user_ctx->sp));
+	/* shrink stack pages unused for a while */
+	task_stack_update(current, user_ctx->sp);
 
 	task = ready_dequeue();
 	if (task == NULL) {
@@ -0,0 +1,123 @@
+#include <slab.h>
+#include <sys.h>
+#include "internal.h"
+
+/* caches which have taken slabs, for kmem_cache_dump() */
+static LIST(kmem_cache_list);
+
+static inline size_t kmem_obj_size(struct kmem_cache *cache)
+{
+	size_t size = cache->size;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	return (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+}
+
+/*
+ * carve a new slab from the kernel heap into free objects. Slabs are
+ * never given back, freed objects only go back to the free list
+ */
+static int kmem_cache_grow(struct kmem_cache *cache)
+{
+	size_t size = kmem_obj_size(cache);
+	unsigned int i, n = SLAB_SIZE / size;
+	char *slab;
+
+	if (n == 0)
+		n = 1;
+
+	slab = (void *)malloc(n * size);
+	if (slab == NULL) {
+		_error("Growing cache \"%s\" failed!!!\n", cache->name);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < n; i++) {
+		*(void **)(slab + i * size) = cache->free_list;
+		cache->free_list = slab + i * size;
+	}
+
+	if (cache->nr_slabs++ == 0)
+		list_add_tail(&kmem_cache_list, &cache->list);
+	cache->nr_objs += n;
+
+	return 0;
+}
+
+/**
+ * initialize an object cache created at run time
+ * @cache: the cache
+ * @name: the name shown in the statistics
+ * @size: the object size
+ */
+void kmem_cache_init(struct kmem_cache *cache, const char *name, size_t size)
+{
+	bzero(cache, sizeof(struct kmem_cache));
+	cache->name = name;
+	cache->size = size;
+	INIT_LIST_ELM(&cache->list);
+
+	return;
+}
+
+/**
+ * take a zeroed object from a cache
+ * @cache: the cache to allocate from
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	void *obj;
+
+	if (cache->free_list == NULL && kmem_cache_grow(cache))
+		return NULL;
+
+	obj = cache->free_list;
+	cache->free_list = *(void **)obj;
+	bzero(obj, cache->size);
+
+	cache->nr_active++;
+	cache->nr_allocs++;
+
+	return obj;
+}
+
+/**
+ * give an object back to its cache
+ * @cache: the cache the object was allocated from
+ * @obj: the object, may be NULL
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	if (obj == NULL)
+		return;
+
+	*(void **)obj = cache->free_list;
+	cache->free_list = obj;
+
+	cache->nr_active--;
+	cache->nr_frees++;
+
+	return;
+}
+
+/*
+ * print the statistics of all caches in use
+ */
+void kmem_cache_dump(void)
+{
+	struct list_head *pos;
+	struct kmem_cache *cache;
+
+	list_for_each(pos, &kmem_cache_list) {
+		cache = list_entry(pos, struct kmem_cache, list);
+		TracePrintf(1, "%-12s size %4u slabs %4lu objs %5lu active %5lu "
+				"allocs %7lu frees %7lu\n",
+				cache->name, (unsigned int)cache->size,
+				cache->nr_slabs, cache->nr_objs,
+				cache->nr_active, cache->nr_allocs,
+				cache->nr_frees);
+	}
+
+	return;
+}
@@ -1,234 +1,797 @@
 #include <hardware.h>
 #include <swap.h>
 #include <process.h>
+#include <pcache.h>
+#include <zswap.h>
 #include <sys.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 
-#define SWAP_PARTITION "_SWAP/"
+#define SWAP_PARTITION_DIR	"_SWAP/"
+#define SWAP_PARTITION		SWAP_PARTITION_DIR "partition"
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
 
-static inline struct task_struct *pick_up_victim_task()
+struct swap_stat swap_stat;
+
+enum swap_victim_policy swap_policy = SWAP_VICTIM_SCORE;
+
+/* set while free frames are short of the high watermark */
+static bool kswapd_wanted = false;
+
+/* the swap partition shared by all processes, one page per slot */
+static int swap_fd = -1;
+static unsigned long swap_map[SWAP_SLOTS / BITS_PER_LONG];
+static unsigned int swap_hint = 0;	/* where the next slot search starts */
+
+/*
+ * create the swap partition the first time a page goes out, at its full
+ * size so that writing a slot never has to extend the file
+ */
+static int swap_partition_open(void)
 {
-	int i;
-	struct task_struct *task;
+	if (swap_fd >= 0)
+		return 0;
+
+	mkdir(SWAP_PARTITION_DIR, S_IRUSR | S_IWUSR | S_IXUSR);
+	swap_fd = open(SWAP_PARTITION, O_RDWR | O_CREAT | O_TRUNC,
+			S_IRUSR | S_IWUSR);
+	if (swap_fd < 0) {
+		_error("Could not open swap partition %s\n", SWAP_PARTITION);
+		return ERROR;
+	}
+	if (ftruncate(swap_fd, (off_t)SWAP_SLOTS << PAGESHIFT)) {
+		_error("Could not size swap partition %s\n", SWAP_PARTITION);
+		close(swap_fd);
+		swap_fd = -1;
+		return ERROR;
+	}
+
+	return 0;
+}
+
+static inline bool slot_used(unsigned int slot)
+{
+	return swap_map[slot / BITS_PER_LONG] & (1UL << (slot % BITS_PER_LONG));
+}
 
-	hash_for_each(process_hash_table, i, task, hlist) {
-		if (task->pid <= 1 || task->pid == current->pid)
+/*
+ * take a free slot of the swap partition, searching on from the last one
+ * taken so that pages going out together land next to each other
+ */
+static int swap_slot_alloc(unsigned int *slot)
+{
+	unsigned int i, n;
+
+	for (i = 0; i < SWAP_SLOTS; i++) {
+		n = (swap_hint + i) % SWAP_SLOTS;
+		if (swap_map[n / BITS_PER_LONG] == ~0UL) {
+			i += BITS_PER_LONG - 1 - n % BITS_PER_LONG;
 			continue;
-		if (task->swapped)
+		}
+		if (slot_used(n))
 			continue;
+		swap_map[n / BITS_PER_LONG] |= 1UL << (n % BITS_PER_LONG);
+		swap_hint = (n + 1) % SWAP_SLOTS;
+		swap_stat.slots_used++;
+		*slot = n;
+		return 0;
+	}
+
+	return ENOMEM;
+}
 
-		return task;
+/**
+ * give a slot of the swap partition back, its content is dropped
+ * @slot: the slot, as recorded in the pfn of a swapped page table entry
+ */
+void swap_slot_free(unsigned int slot)
+{
+	if (slot >= SWAP_SLOTS || !slot_used(slot)) {
+		_error("Freeing swap slot %u which is not in use!\n", slot);
+		return;
 	}
 
-	return NULL;
+	zswap_invalidate(slot);
+	swap_map[slot / BITS_PER_LONG] &= ~(1UL << (slot % BITS_PER_LONG));
+	swap_stat.slots_used--;
+
+	return;
 }
 
 /**
- * swap pages out to disk
- * @table: the page table to be manipulated
- * @start_index: the start page index in the page table to be swapped out
- * @n_page: the number of pages to be swapped out
- * @fd: the file descriptor of the swapping file
+ * write a page to its slot in the swap partition
+ * @slot: the swap slot
+ * @page: the content of the page
  */
-static int pages_swap_out(struct my_pte *table, unsigned int start_index, 
-			  unsigned int n_page, int fd)
+int swap_slot_write(unsigned int slot, void *page)
 {
-	int i, ret = 0;
-	struct my_pte *ptep;
+	if (swap_partition_open())
+		return ERROR;
+
+	if (pwrite(swap_fd, page, PAGESIZE, (off_t)slot << PAGESHIFT)
+			!= PAGESIZE) {
+		_error("Writing swap slot %u failed!\n", slot);
+		return EIO;
+	}
 
-	for (i = start_index; i < start_index + n_page; i++) {
-		ptep = table + i;
+	return 0;
+}
+
+/*
+ * keep the slot a page was read from the swap partition for as long as
+ * the page stays clean. A writable page is mapped read-only copy-on-write,
+ * so that the first write to it goes through task_cow_copy_page() and
+ * marks it dirty. Pages from the compressed tier give their slot up, and
+ * so do pages of shared areas, which must not turn copy-on-write
+ */
+static void swap_cache_add(struct task_struct *task, unsigned int page_index,
+			   unsigned int slot, bool disk)
+{
 #ifdef COW
-		if (ptep->cow)
-			continue;
+	struct my_pte *ptep = task->page_table + page_index;
+	struct vm_area_struct *vma = vma_find(&task->mmap, page_index);
+
+	if (disk && vma && !(vma->flags & VM_SHARED)) {
+		mem_map[ptep->pfn].flags |= FRAME_SWAPCACHE;
+		mem_map[ptep->pfn].swap_slot = slot;
+		if (ptep->prot & PROT_WRITE) {
+			ptep->prot &= ~PROT_WRITE;
+			ptep->cow = 1;
+		}
+		swap_stat.cache_kept++;
+		return;
+	}
 #endif
+	swap_slot_free(slot);
+
+	return;
+}
+
+/**
+ * give up the swap slot a frame is still backed by, when the frame is
+ * freed or its content goes stale
+ * @pfn: the physical frame number
+ */
+void swap_cache_release(unsigned int pfn)
+{
+	if (!(mem_map[pfn].flags & FRAME_SWAPCACHE))
+		return;
+
+	mem_map[pfn].flags &= ~FRAME_SWAPCACHE;
+	swap_slot_free(mem_map[pfn].swap_slot);
+
+	return;
+}
+
+/*
+ * whether the slot a page was swapped in from still has its content
+ */
+static inline bool page_swap_cached(struct my_pte *ptep)
+{
+	return (mem_map[ptep->pfn].flags & FRAME_SWAPCACHE) && !ptep->dirty;
+}
+
+/*
+ * evict a clean page whose slot still has its content, without any I/O
+ */
+static void page_drop_cached(struct task_struct *task, unsigned int page_index)
+{
+	struct my_pte *ptep = task->page_table + page_index;
+	unsigned int pfn = ptep->pfn;
+
+	mem_map[pfn].flags &= ~FRAME_SWAPCACHE;
+	ptep->swap = 1;
+	ptep->ref = 0;
+	ptep->pfn = mem_map[pfn].swap_slot;
+	put_frame(pfn);
+	task->rss--;
+	swap_stat.cache_hits++;
+	swap_stat.writes_avoided += PAGESIZE;
+
+	return;
+}
 
-		ret = write(fd, (void *)PAGE_UADDR(i), PAGESIZE);
-		if (ret != PAGESIZE) {
-			ret = ERROR;
-			goto out;
+/*
+ * move the pages of a batch that go through the swap partition, with one
+ * pwritev() or preadv() per run of consecutive slots. Returns a mask of
+ * the pages whose transfer failed
+ */
+static unsigned int swap_batch_io(struct swap_batch *batch, bool write)
+{
+	struct iovec iov[SWAP_IO_BATCH];
+	struct timeval start, end;
+	unsigned int i, j, n, failed = 0;
+	ssize_t ret;
+
+	for (i = 0; i < batch->n; i = j) {
+		if (!batch->disk[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i, n = 0; j < batch->n && batch->disk[j] &&
+				batch->slots[j] == batch->slots[i] + n; j++, n++) {
+			iov[n].iov_base = batch->addrs[j];
+			iov[n].iov_len = PAGESIZE;
 		}
-		ptep->swap = 1;
-		ptep->valid = 0;
 
-		ret = add_free_frame(ptep->pfn);
-		if (ret)
-			goto out;
+		gettimeofday(&start, NULL);
+		if (write)
+			ret = pwritev(swap_fd, iov, n,
+					(off_t)batch->slots[i] << PAGESHIFT);
+		else
+			ret = preadv(swap_fd, iov, n,
+					(off_t)batch->slots[i] << PAGESHIFT);
+		gettimeofday(&end, NULL);
+		swap_stat.io_calls++;
+		swap_stat.io_usecs += (end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec;
+
+		if (ret != n * PAGESIZE) {
+			_error("Swap %s of slots [%u, %u) failed!\n",
+					write ? "out" : "in",
+					batch->slots[i], batch->slots[i] + n);
+			failed |= ((1U << n) - 1) << i;
+			continue;
+		}
+		swap_stat.io_bytes += ret;
 	}
 
-out:
-	return ret;
+	return failed;
 }
 
 /*
- * try to find a victim process and swap it out to disk
+ * move the resident pages of a batch out to swap slots, compressed in
+ * memory where they shrink well and on the swap partition otherwise,
+ * and free their frames. The page table entries keep the slots in place
+ * of the frames. Returns the number of pages swapped out
  */
-int swap_out(void)
+static unsigned int pages_swap_out(struct task_struct *task,
+				   struct swap_batch *batch)
 {
-	int fd;
-	char file_name[16];
-	struct task_struct *task = NULL;
-	struct phy_free_page *page;
-	int ret = 0;
-
-	_enter("pid = %u", current->pid);
+	struct my_pte *ptep;
+	unsigned int i, n = 0, failed = 0;
+	bool disk = false;
+
+	for (i = 0; i < batch->n; i++) {
+		ptep = task->page_table + batch->pages[i];
+		if (swap_slot_alloc(batch->slots + i))
+			break;
+		batch->addrs[i] = frame_map(ptep->pfn);
+		if (batch->addrs[i] == NULL) {
+			swap_slot_free(batch->slots[i]);
+			break;
+		}
+		batch->disk[i] = zswap_store(batch->slots[i],
+				batch->addrs[i]) != 0;
+		disk |= batch->disk[i];
+	}
+	batch->n = i;
+
+	if (disk && swap_partition_open())
+		failed = ~0U;
+	else if (disk)
+		failed = swap_batch_io(batch, true);
+
+	for (i = 0; i < batch->n; i++) {
+		ptep = task->page_table + batch->pages[i];
+		frame_unmap(batch->addrs[i]);
+		if (batch->disk[i] && (failed & (1U << i))) {
+			swap_slot_free(batch->slots[i]);
+			continue;
+		}
 
-	task = pick_up_victim_task();
-	if (task == NULL) {
-		ret = ERROR;
-		goto out;
+		put_frame(ptep->pfn);
+		ptep->valid = 0;
+		ptep->swap = 1;
+		ptep->ref = 0;
+		ptep->pfn = batch->slots[i];
+		task->rss--;
+		swap_stat.pages_out++;
+		n++;
 	}
 
-	mkdir(SWAP_PARTITION, S_IRUSR | S_IWUSR | S_IXUSR);
-	sprintf(file_name, "%s%u", SWAP_PARTITION, task->pid);
-	fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
-			S_IRUSR | S_IWUSR);
-	if (fd < 0) {
-		_error("Could not open swap file %s\n", file_name);
-		ret = ERROR;
-		goto out;
-	}
-
-	UPDATE_VM1_AND_FLUSH_TLB(task->page_table);
-
-	/* swap text segment out */
-	ret = pages_swap_out(task->page_table, task->code_start,
-			     task->code_pgn, fd);
-	if (ret) {
-		_error("swap #%u text segment out to \"%s\" failed!\n",
-				task->pid, file_name);
-		ret = EIO;
-		goto swap_text_error;
-	}
-
-	/* swap data and heap segment out */
-	ret = pages_swap_out(task->page_table, task->data_start,
-			     PAGE_UINDEX(task->brk) - task->data_start, fd);
-	if (ret) {
-		_error("swap #%u text segment out to \"%s\" failed!\n",
-				task->pid, file_name);
-		ret = EIO;
-		goto swap_data_error;
-	}
-
-swap_data_error:
-	task->swapped = true;
-swap_text_error:
-	UPDATE_VM1_AND_FLUSH_TLB(current->page_table);
-	close(fd);
-out:
-	_leave("swap to \"%s\", ret = %d", file_name, ret);
-	return ret;
+	return n;
 }
 
-/**
- * swap pages in from disk
- * @table: the page table to be manipulated
- * @start_index: the start page index in the page table to be swapped in
- * @n_page: the number of pages to be swapped in
- * @fd: the file descriptor of the swapping file
+/*
+ * read the swapped pages of a batch back into new frames and free their
+ * slots. Returns a mask of the pages brought in, the error of the first
+ * page that could not be is left in batch->ret. A page unmapped by
+ * reclaim while the frames were found is just left out
  */
-static int pages_swap_in(struct my_pte *table, unsigned int start_index, 
-			 unsigned int n_page, int fd)
+static unsigned int pages_swap_in(struct task_struct *task,
+				  struct swap_batch *batch)
 {
-	int i;
 	struct my_pte *ptep;
-	struct phy_frame *frame;
-	int ret = 0;
+	unsigned int i, done = 0, failed = 0, stale = 0;
+	bool disk = false;
 
-	for (i = start_index; i < start_index + n_page; i++) {
-		ptep = table + i;
-		if (!ptep->swap || ptep->valid)
-			continue;
+	batch->ret = 0;
+	for (i = 0; i < batch->n; i++)
+		batch->slots[i] = task->page_table[batch->pages[i]].pfn;
 
-		frame = get_free_frame();
-		if (frame == NULL) {
+	/* frames first: finding one may reclaim through the copy window */
+	for (i = 0; i < batch->n; i++) {
+		if (get_free_frame(batch->frames + i)) {
 			_error("No more physical frames available now!\n");
-			ret = ENOMEM;
-			goto out;
+			batch->ret = ENOMEM;
+			break;
+		}
+	}
+	batch->n = i;
+
+	for (i = 0; i < batch->n; i++) {
+		/* reclaim may have trimmed the page and freed its slot while
+		 * the frames were found */
+		ptep = task->page_table + batch->pages[i];
+		if (!ptep->swap || ptep->pfn != batch->slots[i]) {
+			put_frame(batch->frames[i]);
+			batch->addrs[i] = NULL;
+			batch->disk[i] = false;
+			stale |= 1U << i;
+			continue;
+		}
+		batch->addrs[i] = frame_map(batch->frames[i]);
+		if (batch->addrs[i] == NULL) {
+			while (i < batch->n)
+				put_frame(batch->frames[--batch->n]);
+			batch->ret = batch->ret ? batch->ret : ERROR;
+			break;
 		}
+		batch->disk[i] = zswap_load(batch->slots[i],
+				batch->addrs[i]) != 0;
+		disk |= batch->disk[i];
+	}
 
-		ptep->pfn = frame->index;
-		ptep->valid = 1;
+	if (disk)
+		failed = swap_batch_io(batch, false);
+
+	for (i = 0; i < batch->n; i++) {
+		if (stale & (1U << i))
+			continue;
+		ptep = task->page_table + batch->pages[i];
+		frame_unmap(batch->addrs[i]);
+		if (batch->disk[i] && (failed & (1U << i))) {
+			put_frame(batch->frames[i]);
+			batch->ret = batch->ret ? batch->ret : EIO;
+			continue;
+		}
+
+		ptep->pfn = batch->frames[i];
 		ptep->swap = 0;
-		remove_free_frame(frame);
+		ptep->ref = 1;
+		ptep->dirty = 0;
+		ptep->valid = 1;
+		task->rss++;
+		swap_stat.pages_in++;
+		swap_cache_add(task, batch->pages[i], batch->slots[i],
+				batch->disk[i]);
+		done |= 1U << i;
+	}
+
+	return done;
+}
+
+/*
+ * whether the clock hand may take a page's frame away: it has to be
+ * resident and mapped by nobody else
+ */
+static inline bool page_reclaimable(struct my_pte *ptep)
+{
+	return pte_resident(ptep) && ptep->pfn != zero_frame &&
+		mem_map[ptep->pfn].count == 1;
+}
 
-		ret = read(fd, (void *)PAGE_UADDR(i), PAGESIZE);
-		if (ret != PAGESIZE) {
-			_error("Swap_in page #%u failed! ret = %d\n", i, ret);
-			add_free_frame(ptep->pfn);
+/*
+ * whether a page is an unmodified copy of its executable, which is true
+ * of every program text page, and can be dropped. Besides the task at
+ * most one other holder may be left, usually the page cache
+ */
+static inline bool page_clean_text(struct task_struct *task,
+				   struct vm_area_struct *vma,
+				   unsigned int page_index)
+{
+	struct my_pte *ptep = task->page_table + page_index;
+
+	return (vma->flags & VM_TEXT) && vma->file && pte_resident(ptep) &&
+		ptep->pfn != zero_frame && mem_map[ptep->pfn].count <= 2;
+}
+
+/*
+ * evict a clean text page without any I/O. The page table entry is
+ * cleared, so the next access reads it in from the executable again. A
+ * frame only the page cache would still hold is taken out of the cache
+ * as well. Returns whether the frame went back to the free frames
+ */
+static bool page_drop_text(struct task_struct *task,
+			   struct vm_area_struct *vma, unsigned int page_index)
+{
+	struct my_pte *ptep = task->page_table + page_index;
+	unsigned long offset = vma->offset +
+		((unsigned long)(page_index - vma->start) << PAGESHIFT);
+	unsigned int pfn = ptep->pfn;
+	bool freed = mem_map[pfn].count == 1;
+
+	put_frame(pfn);
+	bzero(ptep, sizeof(struct my_pte));
+	task->rss--;
+	swap_stat.text_dropped++;
+
+	if (!freed && pcache_release(vma->file, offset, pfn) == 0)
+		freed = true;
+
+	return freed;
+}
+
+/*
+ * run the clock hand of a task over the pages of its areas, at most two
+ * rounds, jumping the holes between them. A
+ * referenced page loses its reference bit, an unreferenced one has its
+ * valid bit cleared so that the next access faults and marks it
+ * referenced again, and a page still untouched since then is evicted:
+ * dropped if it is program text or a clean copy of its swap slot,
+ * swapped out otherwise
+ */
+static unsigned int task_reclaim(struct task_struct *task,
+				 unsigned int n_page)
+{
+	unsigned int i, index, n = 0, n_vpage = 0;
+	struct vm_area_struct *vma, *hand = NULL;
+	struct list_head *next;
+	struct my_pte *ptep;
+	bool text;
+	struct tlb_batch batch;
+	struct swap_batch out;
+
+	vma_for_each(vma, &task->mmap) {
+		n_vpage += vma_pgn(vma);
+		if (hand == NULL && vma->end > task->clock_hand)
+			hand = vma;
+	}
+	if (n_vpage == 0)
+		return 0;
+	if (hand == NULL)
+		hand = vma_entry(task->mmap.next);
+	index = max(task->clock_hand, hand->start);
+
+	tlb_batch_init(&batch, task->page_table);
+	out.n = 0;
+	for (i = 0; i < 2 * n_vpage && n + out.n < n_page; i++, index++) {
+		/* past the end of an area, go on with the next one */
+		while (index >= hand->end) {
+			next = hand->list.next;
+			if (next == &task->mmap)
+				next = task->mmap.next;
+			hand = vma_entry(next);
+			index = hand->start;
+		}
+		ptep = task->page_table + index;
+		text = page_clean_text(task, hand, index);
+		if (!text && !page_reclaimable(ptep))
+			continue;
+
+		swap_stat.scanned++;
+		if (ptep->valid && ptep->ref) {
+			ptep->ref = 0;
+		} else if (ptep->valid) {
 			ptep->valid = 0;
-			ptep->swap = 1;
-			ret = ERROR;
-			goto out;
+			tlb_batch_add(&batch, index);
+		} else if (text) {
+			if (page_drop_text(task, hand, index))
+				n++;
+		} else if (page_swap_cached(ptep)) {
+			page_drop_cached(task, index);
+			n++;
+		} else {
+			/* a dirty page gets a fresh slot */
+			swap_cache_release(ptep->pfn);
+			out.pages[out.n++] = index;
+			if (out.n == SWAP_IO_BATCH) {
+				n += pages_swap_out(task, &out);
+				out.n = 0;
+			}
 		}
 	}
+	task->clock_hand = index;
+	tlb_batch_commit(&batch);
+	if (out.n)
+		n += pages_swap_out(task, &out);
 
-	ret = 0;
-out:
-	return ret;
+	return n;
+}
+
+/*
+ * how good a victim a task makes: big, long off the cpu, and better
+ * still if it is blocked in Delay(), TtyRead() and the like
+ */
+static unsigned long victim_score(struct task_struct *task)
+{
+	unsigned long score;
+
+	score = task->rss *
+		(1 + min(jiffies - task->last_run, SWAP_IDLE_MAX));
+	if (task->state == TASK_PENDING)
+		score *= 2;
+
+	return score;
+}
+
+/*
+ * choose the next task to take pages from among those not tried in this
+ * @round yet, walking the tasks from the one that ran longest ago
+ */
+static struct task_struct *pick_victim(unsigned int round)
+{
+	struct task_struct *task, *victim = NULL;
+	struct list_head *pos;
+	unsigned long score, best = 0;
+
+	list_for_each(pos, &task_run_list) {
+		task = list_entry(pos, struct task_struct, run_link);
+		if (task == current || task->page_table == NULL ||
+				task->reclaim_round == round)
+			continue;
+		if (swap_policy == SWAP_VICTIM_LRU)
+			return task;
+		score = victim_score(task);
+		if (score > best) {
+			best = score;
+			victim = task;
+		}
+	}
+
+	return victim;
 }
 
 /**
- * try to swap a process in from disk
- * @task: the process to be swapped in
+ * take frames back, first from retained heap pages and unused stack
+ * pages, then from the resident pages of other processes, page by page
+ * with a per-process clock, until @n_page frames are freed
+ * @n_page: the number of frames wanted
  */
-int swap_in(struct task_struct *task)
+unsigned int reclaim_pages(unsigned int n_page)
 {
-	char file_name[16];
-	int fd, ret = 0;
+	static unsigned int round = 0;
+	struct task_struct *task;
+	struct list_head *pos;
+	unsigned int got, n = 0;
+
+	/* heap pages retained above the break and stack pages below the
+	 * stack pointer cost no I/O, they go first */
+	list_for_each(pos, &task_run_list) {
+		task = list_entry(pos, struct task_struct, run_link);
+		if (task->page_table) {
+			n += task_heap_trim(task, 0);
+			n += task_stack_trim(task);
+		}
+		if (n >= n_page)
+			return n;
+	}
 
-	_enter("pid = %u", task->pid);
+	round++;
+	while (n < n_page) {
+		task = pick_victim(round);
+		if (task == NULL)
+			break;
+		task->reclaim_round = round;
+		got = task_reclaim(task, n_page - n);
+		task->swap_outs += got;
+		swap_stat.victims++;
+		n += got;
+	}
 
-	if (task == NULL) {
-		ret = ERROR;
-		goto out;
+	return n;
+}
+
+/*
+ * free some frames for an allocation which found none
+ */
+int swap_out(void)
+{
+	unsigned int n;
+
+	_enter("pid = %u", current->pid);
+
+	n = reclaim_pages(SWAP_CLUSTER);
+	swap_stat.direct_runs++;
+	swap_stat.direct_pages += n;
+
+	_leave("reclaimed %u pages", n);
+	return n ? 0 : ERROR;
+}
+
+/**
+ * ask for background reclaim, free frames have dropped below the low
+ * watermark
+ */
+void kswapd_wake(void)
+{
+	if (kswapd_wanted)
+		return;
+
+	kswapd_wanted = true;
+	swap_stat.kswapd_wakeups++;
+
+	return;
+}
+
+/**
+ * reclaim a batch of frames in the background once woken, until free
+ * frames are back above the high watermark. It runs from the clock trap,
+ * so that an allocation rarely finds the free lists empty and has to
+ * reclaim by itself
+ */
+void kswapd(void)
+{
+	unsigned int n;
+
+	if (!kswapd_wanted)
+		return;
+
+	if (nr_free_frames() >= FREE_FRAMES_HIGH) {
+		kswapd_wanted = false;
+		return;
 	}
 
-	if (!task->swapped) {
-		ret = ERROR;
-		_error("task #%u is not swapped!\n", task->pid);
-		goto out;
+	n = pcache_shrink(KSWAPD_BATCH);
+	if (n < KSWAPD_BATCH)
+		n += reclaim_pages(KSWAPD_BATCH - n);
+	swap_stat.kswapd_pages += n;
+
+	/* nothing left to take, wait for the next wake up */
+	if (n == 0 || nr_free_frames() >= FREE_FRAMES_HIGH)
+		kswapd_wanted = false;
+
+	return;
+}
+
+/**
+ * bring a swapped page back in on a fault, together with the swapped
+ * pages following it in the same area. The window doubles while faults
+ * come in sequence and halves when they jump around
+ * @task: the faulting task
+ * @page_index: the page index of the faulting page
+ */
+int swap_in_page(struct task_struct *task, unsigned int page_index)
+{
+	struct vm_area_struct *vma;
+	struct swap_batch batch;
+	unsigned int i, end, done;
+
+	if (page_index == task->ra_next)
+		task->ra_window = min(task->ra_window * 2, SWAP_RA_MAX);
+	else
+		task->ra_window = max(task->ra_window / 2, 1);
+
+	vma = vma_find(&task->mmap, page_index);
+	end = vma ? min(page_index + task->ra_window, vma->end) : page_index + 1;
+	batch.n = 0;
+	for (i = page_index; i < end && batch.n < SWAP_IO_BATCH; i++)
+		if (task->page_table[i].swap)
+			batch.pages[batch.n++] = i;
+
+	done = pages_swap_in(task, &batch);
+	if (!(done & 1))
+		return batch.ret;
+	swap_stat.faults_in++;
+
+	/* read ahead pages are left unreferenced, so that the clock hand
+	 * takes them first if they turn out not to be needed */
+	for (i = 1; i < batch.n; i++) {
+		if (!(done & (1U << i)))
+			continue;
+		task->page_table[batch.pages[i]].ref = 0;
+		swap_stat.ra_pages++;
 	}
+	task->ra_next = end;
+
+	return 0;
+}
+
+/*
+ * whether the page at a user address of a task is out in swap
+ */
+static inline bool addr_swapped(struct task_struct *task, void *addr)
+{
+	unsigned long p = (unsigned long)addr;
 
-	ret = sprintf(file_name, "%s%d", SWAP_PARTITION, task->pid);
-	if (ret < 0)
-		goto out;
+	return p >= VMEM_1_BASE && p < VMEM_1_LIMIT &&
+		task->page_table[PAGE_UINDEX(p)].swap;
+}
 
-	fd = open(file_name, O_RDONLY);
-	if (fd < 0) {
-		_error("swap file \"%s\" open error!\n");
-		ret = ERROR;
-		goto out;
+/**
+ * whether a task would fault on swap as soon as it runs, its code or
+ * stack page being swapped out
+ * @task: the task to be dispatched
+ */
+bool task_swapped(struct task_struct *task)
+{
+	if (task->page_table == NULL || swap_stat.slots_used == 0)
+		return false;
+
+	return addr_swapped(task, task->ucontext.pc) ||
+		addr_swapped(task, task->ucontext.sp);
+}
+
+/**
+ * swap in the code and stack pages of a task about to be dispatched,
+ * with their readahead windows, so that it does not start its time
+ * slice faulting on them
+ * @task: the task to be dispatched
+ */
+void swap_in_ahead(struct task_struct *task)
+{
+	void *addrs[2] = { task->ucontext.pc, task->ucontext.sp };
+	unsigned int i, index;
+
+	if (!task_swapped(task))
+		return;
+
+	for (i = 0; i < 2; i++) {
+		if (!addr_swapped(task, addrs[i]))
+			continue;
+		index = PAGE_UINDEX(addrs[i]);
+		if (swap_in_page(task, index))
+			break;
+		swap_stat.ahead_pages++;
 	}
 
-	UPDATE_VM1_AND_FLUSH_TLB(task->page_table);
+	return;
+}
 
-	/* swap text segment in */
-	ret = pages_swap_in(task->page_table, task->code_start,
-			task->code_pgn, fd);
-	if (ret) {
-		_error("Swap in text segment for #%u failed!\n", task->pid);
-		ret = EIO;
-		goto swap_error;
+/*
+ * swap a whole batch in for swap_in(), and empty it
+ */
+static int swap_in_batch(struct task_struct *task, struct swap_batch *batch)
+{
+	/* pages trimmed away meanwhile are no failure */
+	pages_swap_in(task, batch);
+	if (batch->ret) {
+		_error("Swap in for #%u failed!\n", task->pid);
+		return EIO;
 	}
+	batch->n = 0;
 
-	/* swap data segment and heap segment in */
-	ret = pages_swap_in(task->page_table, task->data_start,
-			PAGE_UINDEX(task->brk) - task->data_start, fd);
-	if (ret) {
-		_error("Swap in data and heap segment for #%u failed!\n",
-				task->pid);
-		ret = EIO;
-		goto swap_error;
+	return 0;
+}
+
+/**
+ * bring all swapped pages of a process back in
+ * @task: the process to be swapped in
+ */
+int swap_in(struct task_struct *task)
+{
+	struct vm_area_struct *vma;
+	struct swap_batch batch;
+	unsigned int i;
+	int ret = 0;
+
+	if (task == NULL)
+		return ERROR;
+
+	if (swap_stat.slots_used == 0)
+		return 0;
+
+	_enter("pid = %u", task->pid);
+
+	batch.n = 0;
+	vma_for_each(vma, &task->mmap) {
+		for (i = vma->start; i < vma->end; i++) {
+			if (!task->page_table[i].swap)
+				continue;
+			batch.pages[batch.n++] = i;
+			if (batch.n < SWAP_IO_BATCH)
+				continue;
+			ret = swap_in_batch(task, &batch);
+			if (ret)
+				goto out;
+		}
 	}
+	if (batch.n)
+		ret = swap_in_batch(task, &batch);
 
-swap_error:
-	UPDATE_VM1_AND_FLUSH_TLB(current->page_table);
-	task->swapped = false;
-	close(fd);
-	unlink(file_name);
 out:
 	_leave("ret = %d", ret);
 	return ret;
@@ -7,6 +7,7 @@
 #include <page.h>
 #include <hash.h>
 #include <utility.h>
+#include <swap.h>
 #include "internal.h"
 
 unsigned long jiffies = 0;
@@ -32,6 +33,7 @@ int sys_fork(struct user_context *user_ctx)
 	err = task_vm_copy(child, current);
 	if (err) {
 		_error("task vitural memory copy error!\n");
+		task_fork_abort(child);
 		current->exit_code = ENOMEM;
 		goto out;
 	}
@@ -57,6 +59,7 @@ out:
 int sys_fork_share(struct user_context *user_ctx)
 {
 	struct task_struct *child;
+	int ret;
 
 	_enter();
 
@@ -70,7 +73,12 @@ int sys_fork_share(struct user_context *user_ctx)
 
 	list_add(&current->children_head, &child->child_link);
 
-	task_vm_share_copy(child, current);
+	ret = task_vm_share_copy(child, current);
+	if (ret) {
+		_error("task vitural memory share copy error!\n");
+		task_fork_abort(child);
+		return ret;
+	}
 	task_utilities_copy(child, current);
 
 	current->exit_code = child->pid;
@@ -87,12 +95,42 @@ int sys_fork_share(struct user_context *user_ctx)
 
 void sys_exec(char *filename, char **argv, struct user_context *user_ctx)
 {
+	char **argp;
+	int ret;
+
+	/* the name and the arguments may sit in pages not read in yet */
+	if (task_vm_prefault_string(current, filename))
+		goto out;
+	for (argp = argv; ; argp++) {
+		if (task_vm_prefault(current, argp, sizeof(char *), false))
+			goto out;
+		if (*argp == NULL)
+			break;
+		if (task_vm_prefault_string(current, *argp))
+			goto out;
+	}
+
 	_enter("filename = %s, Current = %u", filename, current->pid);
 
-	sys_load(filename, argv, current);
+	ret = sys_load(filename, argv, current);
+	if (ret == LOAD_KILL) {
+		/* region 1, @filename included, is gone already */
+		_error("Exec failed past the old image, killing %u!\n",
+				current->pid);
+		sys_exit(ERROR, user_ctx);
+		return;
+	}
+	if (ret) {
+		user_ctx->regs[0] = ERROR;
+		return;
+	}
 	*user_ctx = current->ucontext;
 
 	_leave();
+	return;
+out:
+	_error("Exec arguments of %u not accessible!\n", current->pid);
+	user_ctx->regs[0] = ERROR;
 }
 
 void sys_exit(int exit_code, struct user_context *user_ctx)
@@ -115,6 +153,7 @@ void sys_exit(int exit_code, struct user_context *user_ctx)
 	list_del(&current->child_link);
 	list_del(&current->wait_list);
 	hash_del(&current->hlist);
+	list_del(&current->run_link);
 
 	/* allocate zombie to record child exit info */
 	zombie = task_alloc_zombie(current);
@@ -153,6 +192,11 @@ int sys_wait(int *status, struct user_context *user_ctx)
 	while (list_empty(&current->zombie_head))
 		task_wait_child(user_ctx);
 
+	if (task_vm_prefault(current, status, sizeof(*status), true)) {
+		current->exit_code = ERROR;
+		goto out;
+	}
+
 	list = list_first(&current->zombie_head);
 	list_del(list);
 	zombie = list_entry(list, struct zombie_task_struct, link);
@@ -174,7 +218,8 @@ int inline sys_getpid(void)
 
 int sys_brk(unsigned long new_brk)
 {
-	unsigned int start_page_index, page_nr;
+	unsigned int brk_index;
+	struct vm_area_struct *heap, *stack;
 	int ret = 0;
 
 	_enter("current_brk = %p(%u), new_brk = %p(%u)",
@@ -182,35 +227,32 @@ int sys_brk(unsigned long new_brk)
 			new_brk, PAGE_UINDEX(new_brk));
 
 	new_brk = UP_TO_PAGE(new_brk);
+	heap = task_vma(current, VM_HEAP);
+	stack = task_vma(current, VM_STACK);
+	if (heap == NULL || new_brk < PAGE_UADDR(heap->start)) {
+		ret = ERROR;
+		goto out;
+	}
 
+	brk_index = PAGE_UINDEX(new_brk);
 	if (new_brk > current->brk) {
-		if (PAGE_UINDEX(new_brk) >= current->stack_start) {
+		if (brk_index >= stack->start) {
 			_error("you(#%u) have touched the stack!\n",
 					current->pid);
 			ret = ERROR;
 			goto out;
 		}
-		start_page_index = PAGE_UINDEX(current->brk);
-		page_nr = PAGE_NR(new_brk - current->brk);
-		ret = map_pages(current->page_table, start_page_index, page_nr,
-				PROT_READ | PROT_WRITE);
-		if (ret) {
-			_error("expanding Brk for user process (%u) error!\n",
-					current->pid);
-			goto out;
-		}
+		/* pages retained by an earlier shrink are reused, the new
+		 * ones are mapped to zeros on demand */
+		task_heap_reuse(current, PAGE_UINDEX(current->brk),
+				min(brk_index, heap->end));
 		current->brk = new_brk;
-	} else if (current->brk - new_brk > 0) {
-		start_page_index = PAGE_UINDEX(new_brk);
-		page_nr = PAGE_NR(current->brk - new_brk);
-		ret = unmap_pages(current->page_table,
-				start_page_index, page_nr);
-		if (ret) {
-			_error("shrinking Brk for user process (%u) error!\n",
-					current->pid);
-			goto out;
-		}
+		heap->end = max(heap->end, brk_index);
+	} else if (new_brk < current->brk) {
+		/* released pages stay mapped up to the retain limit, so that
+		 * malloc/free cycles do not churn frames and the TLB */
 		current->brk = new_brk;
+		task_heap_trim(current, current->heap_retain);
 	}
 
 out:
@@ -277,7 +319,10 @@ int sys_tty_read(int tty_id, void *buf, size_t len,
 
 	tty_reading_tasks[tty_id] = NULL;
 	tty_read_wake_up_one(tty_id);
-	memcpy(buf, current->tty_buf, current->exit_code);
+	if (task_vm_prefault(current, buf, current->exit_code, true))
+		current->exit_code = ERROR;
+	else
+		memcpy(buf, current->tty_buf, current->exit_code);
 	free(current->tty_buf);
 	current->tty_buf = NULL;
 mem_err:
@@ -288,7 +333,7 @@ mem_err:
 int sys_tty_write(int tty_id, void *buf, size_t len,
 		struct user_context *user_ctx)
 {
-	size_t commit_len;
+	size_t commit_len, n;
 	char *commit_buf;
 	int ret = 0;
 
@@ -310,7 +355,14 @@ int sys_tty_write(int tty_id, void *buf, size_t len,
 
 	/* commit tty-writing multiple times if @buf exceeds
 	 * @TERMINAL_MAX_LINE */
-	len = min(len, strlen(buf));
+	if (task_vm_prefault(current, buf, len, false)) {
+		ret = ERROR;
+		goto out;
+	}
+	/* stop at a NUL, but never look past the @len bytes faulted in */
+	for (n = 0; n < len && ((char *)buf)[n]; n++)
+		;
+	len = n;
 	while (len) {
 		commit_len = min(len, TERMINAL_MAX_LINE);
 		memcpy(commit_buf, buf + ret, commit_len);
@@ -324,6 +376,7 @@ int sys_tty_write(int tty_id, void *buf, size_t len,
 		ret += commit_len;
 	}
 
+out:
 	tty_writing_tasks[tty_id] = NULL;
 	tty_trans_wake_up_one(tty_id);
 	free(commit_buf);
@@ -354,6 +407,12 @@ static int sys_utility_init(unsigned int *id, enum utility_type type)
 		goto out;
 	}
 
+	if (task_vm_prefault(current, id, sizeof(*id), true)) {
+		utility_put(utility);
+		ret = ERROR;
+		goto out;
+	}
+
 	current->utilities[new_id] = utility;
 	*id = new_id;
 out:
@@ -605,3 +664,12 @@ out:
 	_leave("ret = %d", ret);
 	return ret;
 }
+
+/*
+ * how many clean text pages reclaim has dropped so far, for tests
+ * checking that text is evicted and faulted back in
+ */
+int sys_text_dropped(void)
+{
+	return swap_stat.text_dropped;
+}
@@ -0,0 +1,33 @@
+/*
+ * fill and hold memory for a while, checking it kept its contents. Run
+ * by textdrop as a program of its own, so that it maps none of the
+ * parent's text
+ */
+#include <hardware.h>
+#include <yalnix.h>
+
+#include <stdlib.h>
+
+#define HOG_PAGES	96
+
+int main(int argc, char **argv)
+{
+	int i, n_page = HOG_PAGES;
+	char *mem;
+
+	if (argc > 1)
+		n_page = atoi(argv[1]);
+
+	mem = malloc(n_page * PAGESIZE);
+	if (mem == NULL)
+		Exit(-1);
+
+	for (i = 0; i < n_page; i++)
+		mem[i * PAGESIZE] = i;
+	Delay(5);
+	for (i = 0; i < n_page; i++)
+		if (mem[i * PAGESIZE] != (char)i)
+			Exit(-1);
+
+	Exit(0);
+}
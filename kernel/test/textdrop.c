@@ -0,0 +1,75 @@
+/*
+ * text page eviction: memhog programs fill up physical memory while the
+ * parent sleeps, so the clock hand drops the parent's clean text pages.
+ * The hogs are exec'ed, a forked copy would keep mapping the parent's
+ * text frames and make them undroppable. The parent then reads its text
+ * again, which has to come back from the executable unchanged, and
+ * Custom1() tells how many text pages were dropped meanwhile
+ */
+#include <hardware.h>
+#include <yalnix.h>
+
+#include <stdlib.h>
+
+#define NR_HOG		8
+
+int main(int argc, char **argv);
+
+static unsigned int text_sum(void)
+{
+	void *funcs[] = { (void *)main, (void *)text_sum, (void *)malloc,
+			  (void *)atoi };
+	unsigned int i, j, sum = 0;
+	unsigned char *page;
+
+	for (i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
+		page = (unsigned char *)((unsigned long)funcs[i] &
+				~(unsigned long)(PAGESIZE - 1));
+		for (j = 0; j < PAGESIZE; j++)
+			sum = sum * 31 + page[j];
+	}
+
+	return sum;
+}
+
+int main(int argc, char **argv)
+{
+	int i, status, nr_hog = NR_HOG, ret = 0;
+	char *hog_argv[] = { "memhog", NULL, NULL };
+	unsigned int sum;
+	int dropped;
+
+	if (argc > 1)
+		nr_hog = atoi(argv[1]);
+	if (argc > 2)
+		hog_argv[1] = argv[2];
+
+	sum = text_sum();
+	dropped = Custom1(0, 0, 0, 0);
+
+	for (i = 0; i < nr_hog; i++) {
+		if (Fork() == 0) {
+			Exec("./test/memhog", hog_argv);
+			Exit(-1);
+		}
+	}
+
+	/* stay off the cpu while the hogs push the parent's pages out */
+	for (i = 0; i < nr_hog; i++) {
+		Wait(&status);
+		if (status)
+			ret = -1;
+	}
+
+	if (text_sum() != sum) {
+		TtyPrintf(0, "textdrop: text changed after eviction\n");
+		Exit(-1);
+	}
+	if (Custom1(0, 0, 0, 0) == dropped) {
+		TtyPrintf(0, "textdrop: no text page was dropped\n");
+		Exit(-1);
+	}
+
+	TtyPrintf(0, "textdrop: %s\n", ret ? "a hog lost its memory" : "ok");
+	Exit(ret);
+}
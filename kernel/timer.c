@@ -1,8 +1,11 @@
 #include <timer.h>
 #include <sys.h>
 #include <process.h>
+#include <slab.h>
+#include <swap.h>
 
 static struct list_head timer_head = { &timer_head, &timer_head };
+static DEFINE_KMEM_CACHE(timer_cache, "timer", struct timer);
 
 
 /**
@@ -14,7 +17,7 @@ struct timer *alloc_init_timer(unsigned long timeout, struct task_struct *task)
 {
 	struct timer *timer;
 	
-	timer = (void *)calloc(1, sizeof(struct timer));
+	timer = kmem_cache_alloc(&timer_cache);
 	if (timer == NULL) {
 		_error("Allocate timer failed!!!\n");
 		return NULL;
@@ -69,7 +72,8 @@ void wake_up_timer(unsigned long timeout)
 			break;
 		list_del(TO_LIST(timer));
 		task_wake_up(timer->task);
-		free(timer);
+		swap_in_ahead(timer->task);
+		kmem_cache_free(&timer_cache, timer);
 	}
 
 	return;
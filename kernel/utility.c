@@ -1,9 +1,16 @@
 #include <utility.h>
 #include <sys.h>
 #include <hash.h>
+#include <slab.h>
 
 #define PIPE_LEN_DEFAULT	1024
 
+static DEFINE_KMEM_CACHE(utility_cache, "utility", struct utility);
+static DEFINE_KMEM_CACHE(pipe_cache, "pipe", struct pipe);
+static DEFINE_KMEM_CACHE(pipe_buf_cache, "pipe_buf", char [PIPE_LEN_DEFAULT]);
+static DEFINE_KMEM_CACHE(lock_cache, "lock", struct lock);
+static DEFINE_KMEM_CACHE(cvar_cache, "cvar", struct cvar);
+
 #define IS_LOCKED(lock) ((lock)->counter == 0)
 #define LOCK_LOCK(lock)			\
 	do { (lock)->counter--; }	\
@@ -48,13 +55,13 @@ static void *pipe_alloc(struct utility *utility)
 {
 	struct pipe *pipe;
 
-	pipe = (void *)calloc(1, sizeof(struct pipe));
+	pipe = kmem_cache_alloc(&pipe_cache);
 	if (pipe == NULL) {
 		_error("Allocating pipe error!\n");
 		goto pipe_err;
 	}
 
-	pipe->buf = (void *)calloc(1, PIPE_LEN_DEFAULT);
+	pipe->buf = kmem_cache_alloc(&pipe_buf_cache);
 	if (pipe->buf == NULL) {
 		_error("Allocating pipe error!\n");
 		goto buf_err;
@@ -65,7 +72,7 @@ static void *pipe_alloc(struct utility *utility)
 
 	return pipe;
 buf_err:
-	free(pipe);
+	kmem_cache_free(&pipe_cache, pipe);
 pipe_err:
 	return NULL;
 }
@@ -121,6 +128,10 @@ int pipe_do_read(struct utility *utility, char *buf, size_t len,
 
 	/* ring buffer manipulation */
 	n = min(pipe->bytes, len);
+	if (task_vm_prefault(current, buf, n, true)) {
+		ret = ERROR;
+		goto out;
+	}
 	if (pipe->len - pipe->read_p >= n) {
 		memcpy(buf, pipe->buf + pipe->read_p, n);
 		pipe->read_p += n;
@@ -168,6 +179,10 @@ int pipe_do_write(struct utility *utility, char *buf, size_t len,
 continue_write:
 	/* ring buffer manipulation */
 	n = min(len, pipe->len - pipe->bytes);
+	if (task_vm_prefault(current, buf, n, false)) {
+		ret = ERROR;
+		goto out;
+	}
 	if (pipe->len - pipe->write_p >= n) {
 		memcpy(pipe->buf + pipe->write_p, buf, n);
 		pipe->write_p += n;
@@ -212,7 +227,7 @@ static void *lock_alloc(struct utility *utility)
 {
 	struct lock *lock;
 
-	lock = (void *)calloc(1, sizeof(struct lock));
+	lock = kmem_cache_alloc(&lock_cache);
 	if (lock == NULL) {
 		_error("Allocating lock error!\n");
 		goto out;
@@ -299,7 +314,7 @@ static void *cvar_alloc(struct utility *utility)
 {
 	struct cvar *cvar;
 
-	cvar = (void *)calloc(1, sizeof(struct cvar));
+	cvar = kmem_cache_alloc(&cvar_cache);
 	if (cvar == NULL) {
 		_error("Allocating cvar error!\n");
 		goto out;
@@ -439,8 +454,8 @@ static int pipe_free(void *data)
 		goto out;
 	}
 
-	free(pipe->buf);
-	free(pipe);
+	kmem_cache_free(&pipe_buf_cache, pipe->buf);
+	kmem_cache_free(&pipe_cache, pipe);
 out:
 	_leave("ret = %d", ret);
 	return ret;
@@ -464,7 +479,7 @@ static int lock_free(void *data)
 		goto out;
 	}
 
-	free(lock);
+	kmem_cache_free(&lock_cache, lock);
 out:
 	_leave("ret = %d", ret);
 	return ret;
@@ -481,7 +496,7 @@ static int cvar_free(void *data)
 		ret = ERROR;
 		goto out;
 	}
-	free(cvar);
+	kmem_cache_free(&cvar_cache, cvar);
 out:
 	_leave("ret = %d", ret);
 	return 0;
@@ -504,7 +519,7 @@ struct utility *utility_alloc(unsigned int id, enum utility_type type)
 	struct pipe *pipe;
 	void *data;
 	
-	utility = (void *)calloc(1, sizeof(struct utility));
+	utility = kmem_cache_alloc(&utility_cache);
 	if (utility == NULL) {
 		_error("Allocating uitlity error!\n");
 		goto uti_err;
@@ -522,7 +537,7 @@ struct utility *utility_alloc(unsigned int id, enum utility_type type)
 	return utility;
 
 data_err:
-	free(utility);
+	kmem_cache_free(&utility_cache, utility);
 uti_err:
 	return NULL;
 }
@@ -561,7 +576,7 @@ int inline utility_put(struct utility *utility)
 		goto out;
 	}
 
-	free(utility);
+	kmem_cache_free(&utility_cache, utility);
 out:
 	_leave();
 	return ret;
@@ -0,0 +1,223 @@
+#include <vma.h>
+#include <sys.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <slab.h>
+#include "internal.h"
+
+static DEFINE_KMEM_CACHE(vma_cache, "vm_area", struct vm_area_struct);
+static DEFINE_KMEM_CACHE(vm_file_cache, "vm_file", struct vm_file);
+
+/**
+ * allocate the backing file description of an executable
+ * @fd: the opened file, owned by the description from now on
+ * @path: the path the file is opened from
+ */
+struct vm_file *vm_file_alloc(int fd, char *path)
+{
+	struct vm_file *file;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		_error("Stating \"%s\" failed!!!\n", path);
+		return NULL;
+	}
+
+	file = kmem_cache_alloc(&vm_file_cache);
+	if (file == NULL)
+		goto file_err;
+
+	file->path = (void *)malloc(strlen(path) + 1);
+	if (file->path == NULL)
+		goto path_err;
+	strcpy(file->path, path);
+	file->fd = fd;
+	file->count = 1;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->mtime = st.st_mtime;
+
+	return file;
+path_err:
+	kmem_cache_free(&vm_file_cache, file);
+file_err:
+	_error("Allocating vm file for \"%s\" failed!!!\n", path);
+	return NULL;
+}
+
+struct vm_file *vm_file_get(struct vm_file *file)
+{
+	if (file)
+		file->count++;
+	return file;
+}
+
+/*
+ * drop a reference to a backing file, closing it with the last one
+ */
+void vm_file_put(struct vm_file *file)
+{
+	if (file == NULL || --file->count)
+		return;
+
+	close(file->fd);
+	free(file->path);
+	kmem_cache_free(&vm_file_cache, file);
+
+	return;
+}
+
+/**
+ * back an area by an executable file
+ * @vma: the area
+ * @file: the backing file
+ * @offset: the file offset of the first page of the area
+ * @file_size: the number of bytes of the area backed by the file
+ */
+void vma_set_file(struct vm_area_struct *vma, struct vm_file *file,
+		unsigned long offset, unsigned long file_size)
+{
+	vm_file_put(vma->file);
+	vma->file = vm_file_get(file);
+	vma->offset = offset;
+	vma->file_size = file_size;
+
+	return;
+}
+
+/**
+ * allocate a virtual memory area
+ * @start: the first page index of the area
+ * @end: one past the last page index of the area
+ * @flags: VM_* flags of the area
+ * @prot: protection of the page table entries in the area
+ */
+struct vm_area_struct *vma_alloc(unsigned int start, unsigned int end,
+		unsigned int flags, int prot)
+{
+	struct vm_area_struct *vma;
+
+	vma = kmem_cache_alloc(&vma_cache);
+	if (vma == NULL) {
+		_error("Allocating vm area failed!!!\n");
+		return NULL;
+	}
+	INIT_LIST_ELM(&vma->list);
+	vma->start = start;
+	vma->end = end;
+	vma->flags = flags;
+	vma->prot = prot;
+
+	return vma;
+}
+
+/**
+ * insert an area into an address space, keeping it sorted by start
+ * @mmap: the list head of the address space
+ * @vma: the area to be inserted
+ */
+void vma_insert(struct list_head *mmap, struct vm_area_struct *vma)
+{
+	struct vm_area_struct *pos;
+
+	vma_for_each(pos, mmap) {
+		if (vma->start < pos->start) {
+			list_add_tail(&pos->list, &vma->list);
+			return;
+		}
+	}
+	list_add_tail(mmap, &vma->list);
+
+	return;
+}
+
+/**
+ * find the area containing a page
+ * @mmap: the list head of the address space
+ * @index: the page index in region 1
+ */
+struct vm_area_struct *vma_find(struct list_head *mmap, unsigned int index)
+{
+	struct vm_area_struct *vma;
+
+	vma_for_each(vma, mmap) {
+		if (index < vma->start)
+			break;
+		if (index < vma->end)
+			return vma;
+	}
+
+	return NULL;
+}
+
+/**
+ * find the first area having any of @flags
+ * @mmap: the list head of the address space
+ * @flags: VM_* flags to look for
+ */
+struct vm_area_struct *vma_find_flags(struct list_head *mmap,
+		unsigned int flags)
+{
+	struct vm_area_struct *vma;
+
+	vma_for_each(vma, mmap)
+		if (vma->flags & flags)
+			return vma;
+
+	return NULL;
+}
+
+/**
+ * duplicate the areas of an address space into an empty one
+ * @to: the list head of the address space to be copied to
+ * @from: the list head of the address space to be copied from
+ */
+int vma_copy(struct list_head *to, struct list_head *from)
+{
+	struct vm_area_struct *vma, *new;
+
+	vma_for_each(vma, from) {
+		new = vma_alloc(vma->start, vma->end, vma->flags, vma->prot);
+		if (new == NULL) {
+			vma_free_all(to);
+			return ENOMEM;
+		}
+		if (vma->file)
+			vma_set_file(new, vma->file, vma->offset,
+					vma->file_size);
+		list_add_tail(to, &new->list);
+	}
+
+	return 0;
+}
+
+/**
+ * free an area which is not linked to any address space
+ * @vma: the area, may be NULL
+ */
+void vma_free(struct vm_area_struct *vma)
+{
+	if (vma == NULL)
+		return;
+
+	vm_file_put(vma->file);
+	kmem_cache_free(&vma_cache, vma);
+
+	return;
+}
+
+/**
+ * free all the areas of an address space
+ * @mmap: the list head of the address space
+ */
+void vma_free_all(struct list_head *mmap)
+{
+	struct vm_area_struct *vma, *tmp;
+
+	vma_for_each_safe(vma, tmp, mmap) {
+		list_del(&vma->list);
+		vma_free(vma);
+	}
+
+	return;
+}
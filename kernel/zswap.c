@@ -0,0 +1,269 @@
+#include <zswap.h>
+#include <swap.h>
+#include <page.h>
+#include <sys.h>
+#include "internal.h"
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+struct zswap_stat zswap_stat;
+
+static struct zswap_entry zswap_map[SWAP_SLOTS];
+static LIST(zswap_lru);
+
+/* the pool: a fixed arena, so that storing a page never asks the
+ * allocator for memory while it is short of it */
+static unsigned char zswap_pool[ZSWAP_NR_CHUNKS * ZSWAP_CHUNK];
+static unsigned long zswap_pool_map[ZSWAP_NR_CHUNKS / BITS_PER_LONG];
+
+/* scratch space for encoding a page, and for decoding one being
+ * written back meanwhile */
+static unsigned char zswap_buf[PAGESIZE];
+static unsigned char zswap_wb_buf[PAGESIZE];
+
+static inline bool chunk_used(unsigned int chunk)
+{
+	return zswap_pool_map[chunk / BITS_PER_LONG] &
+		(1UL << (chunk % BITS_PER_LONG));
+}
+
+static inline void chunks_set(unsigned int chunk, unsigned int n, bool used)
+{
+	unsigned int i;
+
+	for (i = chunk; i < chunk + n; i++) {
+		if (used)
+			zswap_pool_map[i / BITS_PER_LONG] |=
+				1UL << (i % BITS_PER_LONG);
+		else
+			zswap_pool_map[i / BITS_PER_LONG] &=
+				~(1UL << (i % BITS_PER_LONG));
+	}
+
+	return;
+}
+
+/*
+ * find @n free contiguous chunks of the pool, first fit
+ */
+static int chunks_alloc(unsigned int n, unsigned int *chunk)
+{
+	unsigned int i, run = 0;
+
+	for (i = 0; i < ZSWAP_NR_CHUNKS; i++) {
+		run = chunk_used(i) ? 0 : run + 1;
+		if (run == n) {
+			*chunk = i + 1 - n;
+			chunks_set(*chunk, n, true);
+			return 0;
+		}
+	}
+
+	return ENOMEM;
+}
+
+static inline unsigned int len_chunks(unsigned int len)
+{
+	return (len + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK;
+}
+
+/*
+ * whether a page is one word repeated, the common case being zeros
+ */
+static bool page_same_filled(void *page, unsigned long *fill)
+{
+	unsigned long *p = page;
+	unsigned int i;
+
+	for (i = 1; i < PAGESIZE / sizeof(unsigned long); i++)
+		if (p[i] != p[0])
+			return false;
+	*fill = p[0];
+
+	return true;
+}
+
+/*
+ * run length encode a page into @dest, giving up past @max bytes. A
+ * control byte c < 128 is followed by c + 1 literal bytes, a control
+ * byte c >= 128 by one byte repeated c - 125 times
+ */
+static unsigned int rle_encode(unsigned char *src, unsigned char *dest,
+			       unsigned int max)
+{
+	unsigned int i = 0, j, n = 0, run;
+
+	while (i < PAGESIZE) {
+		for (run = 1; i + run < PAGESIZE && run < 130 &&
+				src[i + run] == src[i]; run++)
+			;
+		if (run >= 3) {
+			if (n + 2 > max)
+				return 0;
+			dest[n++] = run + 125;
+			dest[n++] = src[i];
+			i += run;
+			continue;
+		}
+
+		/* literals up to the next run of three */
+		for (j = i; j < PAGESIZE && j - i < 128; j++)
+			if (j + 2 < PAGESIZE && src[j] == src[j + 1] &&
+					src[j] == src[j + 2])
+				break;
+		if (n + 1 + j - i > max)
+			return 0;
+		dest[n++] = j - i - 1;
+		memcpy(dest + n, src + i, j - i);
+		n += j - i;
+		i = j;
+	}
+
+	return n;
+}
+
+static void rle_decode(unsigned char *src, unsigned int len,
+		       unsigned char *dest)
+{
+	unsigned int i = 0, n = 0, c;
+
+	while (i < len) {
+		c = src[i++];
+		if (c < 128) {
+			memcpy(dest + n, src + i, c + 1);
+			i += c + 1;
+			n += c + 1;
+		} else {
+			memset(dest + n, src[i++], c - 125);
+			n += c - 125;
+		}
+	}
+
+	return;
+}
+
+static void zswap_decode(struct zswap_entry *entry, void *page)
+{
+	unsigned long *p = page;
+	unsigned int i;
+
+	if (entry->kind == ZSWAP_SAME) {
+		for (i = 0; i < PAGESIZE / sizeof(unsigned long); i++)
+			p[i] = entry->fill;
+	} else {
+		rle_decode(zswap_pool + entry->chunk * ZSWAP_CHUNK,
+				entry->len, page);
+	}
+
+	return;
+}
+
+static void zswap_remove(struct zswap_entry *entry)
+{
+	if (entry->kind == ZSWAP_RLE) {
+		list_del(&entry->lru);
+		chunks_set(entry->chunk, len_chunks(entry->len), false);
+		zswap_stat.pool_bytes -= entry->len;
+	}
+	zswap_stat.orig_bytes -= PAGESIZE;
+	entry->kind = ZSWAP_NONE;
+
+	return;
+}
+
+/*
+ * spill the oldest encoded page to its slot on disk to make room
+ */
+static int zswap_writeback(void)
+{
+	struct zswap_entry *entry;
+	int ret;
+
+	if (list_empty(&zswap_lru))
+		return ENOMEM;
+
+	entry = list_entry(list_first(&zswap_lru), struct zswap_entry, lru);
+	zswap_decode(entry, zswap_wb_buf);
+	ret = swap_slot_write(entry - zswap_map, zswap_wb_buf);
+	if (ret)
+		return ret;
+	zswap_remove(entry);
+	zswap_stat.written_back++;
+
+	return 0;
+}
+
+/**
+ * keep a page going out to swap in memory, compressed, instead of
+ * writing it to disk. Older pages are written back when the pool is out
+ * of room. ERROR means the page has to go to disk
+ * @slot: the swap slot of the page
+ * @page: the content of the page
+ */
+int zswap_store(unsigned int slot, void *page)
+{
+	struct zswap_entry *entry = zswap_map + slot;
+	unsigned int len, chunk;
+
+	if (page_same_filled(page, &entry->fill)) {
+		entry->kind = ZSWAP_SAME;
+		zswap_stat.same_filled++;
+		goto out;
+	}
+
+	len = rle_encode(page, zswap_buf, ZSWAP_MAX_LEN);
+	if (len == 0) {
+		zswap_stat.rejected++;
+		return ERROR;
+	}
+
+	while (chunks_alloc(len_chunks(len), &chunk))
+		if (zswap_writeback())
+			return ERROR;
+
+	memcpy(zswap_pool + chunk * ZSWAP_CHUNK, zswap_buf, len);
+	entry->kind = ZSWAP_RLE;
+	entry->chunk = chunk;
+	entry->len = len;
+	list_add_tail(&zswap_lru, &entry->lru);
+	zswap_stat.pool_bytes += len;
+
+out:
+	zswap_stat.orig_bytes += PAGESIZE;
+	zswap_stat.stored++;
+	return 0;
+}
+
+/**
+ * fill a page swapping in from memory if the compressed tier has it,
+ * the slot is given up by the tier then. ERROR means it is on disk
+ * @slot: the swap slot of the page
+ * @page: where the content goes
+ */
+int zswap_load(unsigned int slot, void *page)
+{
+	struct zswap_entry *entry = zswap_map + slot;
+
+	if (entry->kind == ZSWAP_NONE) {
+		zswap_stat.misses++;
+		return ERROR;
+	}
+
+	zswap_decode(entry, page);
+	zswap_remove(entry);
+	zswap_stat.hits++;
+
+	return 0;
+}
+
+/**
+ * drop whatever the compressed tier holds for a swap slot being freed
+ * @slot: the swap slot
+ */
+void zswap_invalidate(unsigned int slot)
+{
+	if (zswap_map[slot].kind != ZSWAP_NONE)
+		zswap_remove(zswap_map + slot);
+
+	return;
+}